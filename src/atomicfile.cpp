@@ -0,0 +1,117 @@
+//
+//  atomicfile.cpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "atomicfile.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+
+
+static std::atomic<unsigned> counter(0);
+
+AtomicFile::~AtomicFile() {
+    if (fd != -1)
+        close(fd);
+    if (!temporary.empty())
+        unlink(temporary.c_str());
+}
+
+int AtomicFile::Open() {
+    // O_EXCL instead of mkstemp so that mode follows umask as for the final
+    // file. Name is hidden and unique per process and output.
+    size_t slash = filename.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ?
+        std::string() : filename.substr(0, slash + 1);
+    std::string base = filename.substr(dir.size());
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        char suffix[48];
+        snprintf(suffix, sizeof(suffix), ".tmp-%ld-%u",
+            static_cast<long>(getpid()), counter++);
+        temporary = dir + "." + base + suffix;
+        fd = open(temporary.c_str(),
+            O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd != -1)
+            return fd;
+        if (errno != EEXIST)
+            break;
+    }
+    temporary.clear();
+    return -1;
+}
+
+bool AtomicFile::Write(const void* Data, size_t Length) {
+    const char* src = reinterpret_cast<const char*>(Data);
+    while (Length) {
+        ssize_t count = write(fd, src, Length);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        src += count;
+        Length -= count;
+    }
+    return true;
+}
+
+bool AtomicFile::Reserve(std::uint64_t Size, bool Exact) {
+    if (fd == -1 || Size == 0)
+        return true;
+    int status = 0;
+    if (Exact)
+        status = posix_fallocate(fd, 0, Size);
+#if defined(__linux__)
+    else if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, Size) != 0)
+        status = errno;
+#endif
+    // Other errors mean that file system does not support it.
+    if (status == ENOSPC || status == EFBIG) {
+        errno = status;
+        return false;
+    }
+    return true;
+}
+
+// Replaced file keeps its permissions instead of getting the default mode.
+static bool keep_mode(const std::string& Target, int Fd,
+    const std::string& Temporary)
+{
+    struct stat st;
+    if (stat(Target.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return true;
+    mode_t mode = st.st_mode & 07777;
+    if (Fd != -1)
+        return fchmod(Fd, mode) == 0;
+    return chmod(Temporary.c_str(), mode) == 0;
+}
+
+bool AtomicFile::Commit(bool Sync) {
+    if (temporary.empty())
+        return false;
+    bool ok = true;
+    if (fd == -1 && Sync) {
+        // Written by name so open to flush.
+        fd = open(temporary.c_str(), O_RDONLY | O_CLOEXEC);
+        ok = fd != -1;
+    }
+    ok = ok && keep_mode(filename, fd, temporary);
+    if (ok && Sync)
+        ok = fdatasync(fd) == 0;
+    if (fd != -1) {
+        if (close(fd) != 0)
+            ok = false;
+        fd = -1;
+    }
+    ok = ok && rename(temporary.c_str(), filename.c_str()) == 0;
+    if (ok)
+        temporary.clear();
+    return ok;
+}
@@ -0,0 +1,50 @@
+//
+//  atomicfile.hpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Output file that is written under a temporary name in the same directory
+// and renamed to the final name when complete. Readers never see a partial
+// file and a failed write leaves any earlier file in place. A replaced file
+// keeps its permissions.
+
+#if !defined(ATOMICFILE_HPP)
+#define ATOMICFILE_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+
+class AtomicFile {
+private:
+    std::string filename, temporary;
+    int fd;
+
+public:
+    AtomicFile(const std::string& Filename) : filename(Filename), fd(-1) { }
+    // Removes the temporary file unless committed.
+    ~AtomicFile();
+
+    // Creates the temporary file. Returns descriptor or -1 with errno set.
+    int Open();
+    // Temporary file name for writers that open by name.
+    const std::string& Name() const { return temporary; }
+
+    // Writes all of Data. Returns false with errno set on failure.
+    bool Write(const void* Data, size_t Length);
+
+    // Reserves Size bytes so that running out of space is found before
+    // writing. Exact sets file size, otherwise size is kept for writers that
+    // append. Returns false only if there is not enough space.
+    bool Reserve(std::uint64_t Size, bool Exact);
+
+    // Optionally flushes data to disk, sets the mode of an existing file,
+    // closes and renames. Returns false with errno set on failure.
+    bool Commit(bool Sync);
+};
+
+#endif
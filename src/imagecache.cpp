@@ -0,0 +1,236 @@
+//
+//  imagecache.cpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "imagecache.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+
+
+static const char magic[8] = { 'I', 'M', 'G', 'C', 'A', 'C', 'H', 'E' };
+static const std::uint32_t version = 1;
+static const size_t header_size = 32;
+static const char suffix[] = ".imgcache";
+static const char temp_prefix[] = ".tmp-";
+// Temporary files not modified for this many seconds were left by writers
+// that did not finish.
+static const time_t stale_temp = 3600;
+
+struct Header {
+    char magic[8];
+    std::uint32_t version, key_length, height, width, components, data;
+};
+
+static std::string entry_name(
+    const std::string& Directory, const std::string& Key)
+{
+    // FNV-1a, key stored in entry is compared on read.
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (char c : Key) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx",
+        static_cast<unsigned long long>(hash));
+    return Directory + name + suffix;
+}
+
+std::string cacheKey(
+    int Fd, const std::string& Filename, const std::string& Extra)
+{
+    struct stat info;
+    if (fstat(Fd, &info) == -1)
+        return std::string();
+    std::string key;
+    char* real = realpath(Filename.c_str(), nullptr);
+    if (real) {
+        key = real;
+        free(real);
+    } else
+        key = Filename;
+    char identity[128];
+    snprintf(identity, sizeof(identity), "\n%llu:%llu:%lld:%lld.%09ld\n",
+        static_cast<unsigned long long>(info.st_dev),
+        static_cast<unsigned long long>(info.st_ino),
+        static_cast<long long>(info.st_size),
+        static_cast<long long>(info.st_mtim.tv_sec),
+        static_cast<long>(info.st_mtim.tv_nsec));
+    key += identity;
+    key += Extra;
+    return key;
+}
+
+bool cacheLoad(const std::string& Directory, const std::string& Key,
+    std::vector<std::vector<std::vector<float>>>& Image)
+{
+    int fd = open(entry_name(Directory, Key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size < off_t(header_size)) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    const char* bytes = reinterpret_cast<const char*>(map);
+    Header h;
+    memcpy(&h, bytes, sizeof(h));
+    size_t values = size_t(h.height) * h.width * h.components;
+    bool ok = memcmp(h.magic, magic, sizeof(magic)) == 0 &&
+        h.version == version && h.key_length == Key.size() &&
+        header_size + h.key_length <= h.data &&
+        size_t(info.st_size) == h.data + values * sizeof(float) &&
+        memcmp(bytes + header_size, Key.c_str(), Key.size()) == 0;
+    if (ok) {
+        madvise(map, info.st_size, MADV_SEQUENTIAL);
+        const float* src = reinterpret_cast<const float*>(bytes + h.data);
+        Image.resize(h.height);
+        for (auto& line : Image) {
+            line.resize(h.width);
+            for (auto& pixel : line) {
+                pixel.assign(src, src + h.components);
+                src += h.components;
+            }
+        }
+        futimens(fd, nullptr); // Mark as recently used.
+    }
+    munmap(map, info.st_size);
+    close(fd);
+    return ok;
+}
+
+static bool write_all(int fd, const char* Data, size_t Length) {
+    while (Length) {
+        ssize_t count = write(fd, Data, Length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        Data += count;
+        Length -= count;
+    }
+    return true;
+}
+
+struct Entry {
+    struct timespec used;
+    off_t size;
+    std::string name;
+
+    bool operator<(const Entry& E) const {
+        if (used.tv_sec != E.used.tv_sec)
+            return used.tv_sec < E.used.tv_sec;
+        return used.tv_nsec < E.used.tv_nsec;
+    }
+};
+
+// Removes stale temporary files and least recently used entries.
+static void evict(const std::string& Directory, size_t Limit) {
+    DIR* dir = opendir(Directory.c_str());
+    if (!dir)
+        return;
+    std::vector<Entry> entries;
+    size_t total = 0;
+    const size_t suffix_length = sizeof(suffix) - 1;
+    const size_t prefix_length = sizeof(temp_prefix) - 1;
+    const time_t now = time(nullptr);
+    while (struct dirent* d = readdir(dir)) {
+        if (strncmp(d->d_name, temp_prefix, prefix_length) == 0) {
+            std::string name = Directory + "/" + d->d_name;
+            struct stat info;
+            if (stat(name.c_str(), &info) == 0 &&
+                info.st_mtime + stale_temp < now)
+                    unlink(name.c_str());
+            continue;
+        }
+        size_t length = strlen(d->d_name);
+        if (length <= suffix_length ||
+            strcmp(d->d_name + length - suffix_length, suffix) != 0)
+                continue;
+        std::string name = Directory + "/" + d->d_name;
+        struct stat info;
+        if (stat(name.c_str(), &info) == -1)
+            continue;
+        entries.push_back(Entry { info.st_mtim, info.st_size, name });
+        total += info.st_size;
+    }
+    closedir(dir);
+    if (total <= Limit)
+        return;
+    std::sort(entries.begin(), entries.end());
+    for (auto& e : entries) {
+        if (total <= Limit)
+            break;
+        if (unlink(e.name.c_str()) == 0)
+            total -= e.size;
+    }
+}
+
+bool cacheStore(const std::string& Directory, const std::string& Key,
+    const std::vector<std::vector<std::vector<float>>>& Image, size_t Limit)
+{
+    Header h;
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.key_length = Key.size();
+    h.height = Image.size();
+    h.width = Image.empty() ? 0 : Image[0].size();
+    h.components = h.width ? Image[0][0].size() : 0;
+    h.data = (header_size + Key.size() + 15) & ~std::uint32_t(15);
+    size_t values = size_t(h.height) * h.width * h.components;
+    if (Limit < h.data + values * sizeof(float))
+        return false;
+    std::string tmp = Directory + "/" + temp_prefix + "XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd == -1)
+        return false;
+    std::vector<char> buf(h.data, 0);
+    memcpy(&buf.front(), &h, sizeof(h));
+    memcpy(&buf.front() + header_size, Key.c_str(), Key.size());
+    bool ok = write_all(fd, &buf.front(), buf.size());
+    std::vector<float> row;
+    row.reserve(size_t(h.width) * h.components);
+    for (auto& line : Image) {
+        if (!ok)
+            break;
+        row.resize(0);
+        for (auto& pixel : line) {
+            if (pixel.size() != h.components) {
+                ok = false;
+                break;
+            }
+            row.insert(row.end(), pixel.begin(), pixel.end());
+        }
+        ok = ok && write_all(fd, reinterpret_cast<const char*>(row.data()),
+            row.size() * sizeof(float));
+    }
+    if (close(fd) == -1)
+        ok = false;
+    if (ok)
+        ok = rename(tmp.c_str(), entry_name(Directory, Key).c_str()) == 0;
+    if (!ok) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    evict(Directory, Limit);
+    return true;
+}
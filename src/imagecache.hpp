@@ -0,0 +1,51 @@
+//
+//  imagecache.hpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// On-disk cache of decoded images. Each entry is a file in the cache
+// directory with a fixed header followed by height * width * components
+// floats in host byte order:
+//
+// offset  size  contents
+//  0      8     "IMGCACHE"
+//  8      4     version, 1
+// 12      4     key length in bytes
+// 16      4     height
+// 20      4     width
+// 24      4     components
+// 28      4     offset of float data, multiple of 16
+// 32      key   key, followed by padding up to data offset
+//
+// Entries are read using mmap. Reading an entry updates its modification time
+// and least recently used entries are removed when the total size of entries
+// exceeds the limit.
+
+#if !defined(IMAGECACHE_HPP)
+#define IMAGECACHE_HPP
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+
+// Returns key for file open as Fd based on path, device, inode, size and
+// modification time, with Extra appended. Empty if file information is not
+// available. Using the descriptor that is read keeps the key correct if the
+// path is replaced meanwhile.
+std::string cacheKey(
+    int Fd, const std::string& Filename, const std::string& Extra);
+
+// Returns true if entry for Key was found and read into Image.
+bool cacheLoad(const std::string& Directory, const std::string& Key,
+    std::vector<std::vector<std::vector<float>>>& Image);
+
+// Stores Image as entry for Key and removes old entries beyond Limit bytes.
+// Returns false if the entry could not be written.
+bool cacheStore(const std::string& Directory, const std::string& Key,
+    const std::vector<std::vector<std::vector<float>>>& Image, size_t Limit);
+
+#endif
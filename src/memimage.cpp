@@ -11,109 +11,481 @@
 #include <cinttypes>
 #if !defined(NO_PNG)
 #include <cstring>
+#include <strings.h>
 #include <memory>
 #include <csetjmp>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <png.h>
+#include <zlib.h>
+#include <cerrno>
+#include <unistd.h>
 #endif
 
 
-template<typename T>
-class Buffer : public std::vector<T> {
+#if !defined(NO_PNG)
+static bool write_all(int Fd, const unsigned char* Data, size_t Length) {
+    while (Length) {
+        ssize_t count = write(Fd, Data, Length);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        Data += count;
+        Length -= count;
+    }
+    return true;
+}
+
+bool PNGFileSink::Write(const unsigned char* Data, size_t Length) {
+    if (buffer.size() - used < Length) {
+        if (!Flush())
+            return false;
+        if (buffer.size() <= Length)
+            return write_all(fd, Data, Length);
+    }
+    memcpy(buffer.data() + used, Data, Length);
+    used += Length;
+    return true;
+}
+
+bool PNGFileSink::Flush() {
+    bool ok = write_all(fd, buffer.data(), used);
+    used = 0;
+    return ok;
+}
+
+bool PNGBufferSink::Write(const unsigned char* Data, size_t Length) {
+    if (out.capacity() - out.size() < Length)
+        out.reserve(std::max(2 * out.capacity(), out.size() + Length));
+    out.insert(out.end(), Data, Data + Length);
+    return true;
+}
+
+// Error pointer is the message of the encoder in use.
+static void png_error_handler(png_structp png, const char* error) {
+    *reinterpret_cast<std::string*>(png_get_error_ptr(png)) = error;
+    png_longjmp(png, 1);
+}
+
+static void png_warning_handler(png_structp unused, const char* unused2) { }
+
+static const size_t band_bytes = 262144;
+
+// Owns libpng write and info structs for one image.
+class WriteStructs {
 public:
-    Buffer& operator<<(T c) {
-        this->push_back(c);
-        return *this;
+    png_structp png;
+    png_infop info;
+
+    WriteStructs(std::string& Error) : png(nullptr), info(nullptr) {
+        png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+            &Error, &png_error_handler, &png_warning_handler);
+        if (png)
+            info = png_create_info_struct(png);
     }
 
-    Buffer& write_u32(std::uint32_t s) {
-        this->push_back((s >> 24) & 0xff);
-        this->push_back((s >> 16) & 0xff);
-        this->push_back((s >> 8) & 0xff);
-        this->push_back(s & 0xff);
-        return *this;
+    ~WriteStructs() {
+        if (png)
+            png_destroy_write_struct(&png, info ? &info : nullptr);
     }
 };
 
-#if !defined(NO_PNG)
-static void png_error_handler(png_structp unused, const char* error) {
-    throw error;
+static void append(png_structp Png, png_bytep Data, size_t Length) {
+    if (!reinterpret_cast<PNGSink*>(png_get_io_ptr(Png))->Write(Data, Length))
+        png_error(Png, "Failed to write.");
 }
 
-static void png_warning_handler(png_structp unused, const char* unused2) { }
+static void flush_nothing(png_structp unused) { }
 
-typedef void (*png_destroyer)(png_structp);
-static void destroy_png(png_structp p) {
-    png_destroy_write_struct(&p, nullptr);
+bool pngCompression(const std::string& Name, PNGOptions& Options) {
+    if (strcasecmp(Name.c_str(), "deflate") == 0)
+        return true;
+    if (strcasecmp(Name.c_str(), "store") == 0) {
+        // Filtering does not help when nothing is compressed.
+        Options.level = 0;
+        Options.filters = PNG_FILTER_NONE;
+        return true;
+    }
+    return false;
 }
 
-typedef void (*info_destroyer)(png_infop);
-static png_structp png_s = nullptr;
-static void destroy_info(png_infop p) {
-    png_destroy_info_struct(png_s, &p);
+bool pngFilter(const std::string& Name, PNGOptions& Options) {
+    static const struct {
+        const char* name;
+        int filters;
+    } filters[] = {
+        { "none", PNG_FILTER_NONE },
+        { "sub", PNG_FILTER_SUB },
+        { "up", PNG_FILTER_UP },
+        { "average", PNG_FILTER_AVG },
+        { "paeth", PNG_FILTER_PAETH },
+        { "all", PNG_ALL_FILTERS }
+    };
+    for (auto& f : filters)
+        if (strcasecmp(Name.c_str(), f.name) == 0) {
+            Options.filters = f.filters;
+            return true;
+        }
+    return false;
 }
 
-static void append(png_structp Png, png_bytep Data, size_t Length) {
-    std::vector<unsigned char>* out =
-        reinterpret_cast<std::vector<unsigned char>*>(png_get_io_ptr(Png));
-    out->resize(out->size() + Length);
-    memcpy(&(out->front()) + (out->size() - Length), Data, Length);
+// Calls Func(k) for k in [0, Count) using at most Threads threads.
+template<typename Function>
+static void for_each_parallel(size_t Count, size_t Threads, Function Func) {
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t k = next++; k < Count; k = next++)
+            Func(k);
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < std::min(Count, Threads); ++w)
+        pool.push_back(std::thread(work));
+    work();
+    for (auto& thread : pool)
+        thread.join();
 }
 
-std::vector<unsigned char> memoryPNG(
-    const std::vector<std::vector<std::vector<float>>>& Image, int Depth)
+static void put_u32(std::vector<unsigned char>& Out, std::uint32_t Value) {
+    Out.push_back((Value >> 24) & 0xff);
+    Out.push_back((Value >> 16) & 0xff);
+    Out.push_back((Value >> 8) & 0xff);
+    Out.push_back(Value & 0xff);
+}
+
+typedef std::pair<const unsigned char*, size_t> Piece;
+
+// Writes chunk with data concatenated from Pieces.
+static bool put_chunk(PNGSink& Sink, const char* Type,
+    std::initializer_list<Piece> Pieces)
 {
-    std::vector<unsigned char> out;
-    std::unique_ptr<png_struct,png_destroyer> png(
-        png_create_write_struct(PNG_LIBPNG_VER_STRING,
-            nullptr, &png_error_handler, &png_warning_handler),
-        &destroy_png);
-    if (!png)
-        return out;
-    png_set_write_fn(png.get(), reinterpret_cast<void*>(&out), append, nullptr);
-    png_s = png.get();
-    std::unique_ptr<png_info,info_destroyer> info(
-        png_create_info_struct(png.get()), &destroy_info);
-    if (!info)
-        return out;
-    if (setjmp(png_jmpbuf(png.get())))
-        return out;
+    std::vector<unsigned char> head;
+    size_t length = 0;
+    for (auto& piece : Pieces)
+        length += piece.second;
+    put_u32(head, length);
+    head.insert(head.end(), Type, Type + 4);
+    uLong crc = crc32(0, &head[4], 4);
+    if (!Sink.Write(head.data(), head.size()))
+        return false;
+    for (auto& piece : Pieces) {
+        if (!piece.second)
+            continue;
+        crc = crc32(crc, piece.first, piece.second);
+        if (!Sink.Write(piece.first, piece.second))
+            return false;
+    }
+    head.resize(0);
+    put_u32(head, crc);
+    return Sink.Write(head.data(), head.size());
+}
+
+static unsigned char paeth(int A, int B, int C) {
+    int p = A + B - C;
+    int pa = abs(p - A), pb = abs(p - B), pc = abs(p - C);
+    if (pa <= pb && pa <= pc)
+        return A;
+    return (pb <= pc) ? B : C;
+}
+
+// Applies filter Type to Row and stores type byte and result to Out.
+static void apply_filter(unsigned char* Out, int Type, const unsigned char* Row,
+    const unsigned char* Previous, size_t Length, size_t Bpp)
+{
+    *Out++ = Type;
+    for (size_t k = 0; k < Length; ++k) {
+        int a = (Bpp <= k) ? Row[k - Bpp] : 0;
+        int b = Previous ? Previous[k] : 0;
+        int c = (Previous && Bpp <= k) ? Previous[k - Bpp] : 0;
+        switch (Type) {
+        case 0: Out[k] = Row[k]; break;
+        case 1: Out[k] = Row[k] - a; break;
+        case 2: Out[k] = Row[k] - b; break;
+        case 3: Out[k] = Row[k] - ((a + b) >> 1); break;
+        case 4: Out[k] = Row[k] - paeth(a, b, c); break;
+        }
+    }
+}
+
+// Picks among allowed filters the one with smallest sum of absolute values of
+// signed bytes, as libpng does.
+static void filter_row(unsigned char* Out, std::vector<unsigned char>& Scratch,
+    const unsigned char* Row, const unsigned char* Previous, size_t Length,
+    size_t Bpp, int Filters)
+{
+    int best = -1;
+    size_t best_sum = 0;
+    for (int type = 0; type < 5; ++type) {
+        if (!(Filters & (PNG_FILTER_NONE << type)))
+            continue;
+        unsigned char* target = (best < 0) ? Out : &Scratch.front();
+        apply_filter(target, type, Row, Previous, Length, Bpp);
+        size_t sum = 0;
+        for (size_t k = 1; k <= Length; ++k)
+            sum += abs(static_cast<signed char>(target[k]));
+        if (best < 0 || sum < best_sum) {
+            if (0 <= best)
+                memcpy(Out, target, Length + 1);
+            best = type;
+            best_sum = sum;
+        }
+    }
+}
+
+// Stores Line as big-endian samples of Depth bits to Out.
+static void pack_row(unsigned char* Out,
+    const std::vector<std::vector<float>>& Line, int Depth)
+{
+    for (auto& pixel : Line)
+        if (Depth == 8)
+            for (auto& component : pixel)
+                *Out++ = static_cast<unsigned char>(component);
+        else
+            for (auto& component : pixel) {
+                std::uint16_t val = static_cast<std::uint16_t>(component);
+                *Out++ = (val >> 8) & 0xff;
+                *Out++ = val & 0xff;
+            }
+}
+
+// Rows of a band as packed samples, filtered and deflated. Buffers are reused
+// for the band in the same position of the next round.
+struct Band {
+    std::vector<unsigned char> packed, filtered, data;
+    uLong adler;
+    bool ok;
+};
+
+// Packs rows [Begin, End) and the row before them, then filters the rows.
+static void filter_band(Band& B,
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    size_t Begin, size_t End, size_t RowSize, size_t Bpp, int Filters)
+{
+    const size_t first = Begin ? Begin - 1 : Begin;
+    B.packed.resize((End - first) * RowSize);
+    for (size_t y = first; y < End; ++y)
+        pack_row(&B.packed[(y - first) * RowSize], Image[y], Depth);
+    B.filtered.resize((End - Begin) * (RowSize + 1));
+    std::vector<unsigned char> scratch(RowSize + 1);
+    for (size_t y = Begin; y < End; ++y) {
+        const unsigned char* row = &B.packed[(y - first) * RowSize];
+        filter_row(&B.filtered[(y - Begin) * (RowSize + 1)], scratch, row,
+            y ? row - RowSize : nullptr, RowSize, Bpp, Filters);
+    }
+}
+
+// Deflates filtered rows of B primed with Dictionary, the data before them.
+static void deflate_band(Band& B, const unsigned char* Dictionary,
+    size_t DictLength, bool Last, int Level, int Strategy)
+{
+    B.ok = false;
+    B.adler = adler32(1, B.filtered.data(), B.filtered.size());
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, Level, Z_DEFLATED, -15, 8, Strategy) != Z_OK)
+        return;
+    if (DictLength)
+        deflateSetDictionary(&strm, Dictionary, DictLength);
+    strm.next_in = B.filtered.data();
+    strm.avail_in = B.filtered.size();
+    B.data.resize(deflateBound(&strm, B.filtered.size()) + 64);
+    strm.next_out = &B.data.front();
+    strm.avail_out = B.data.size();
+    int flush = Last ? Z_FINISH : Z_FULL_FLUSH;
+    while (true) {
+        int status = deflate(&strm, flush);
+        if (status == Z_STREAM_ERROR)
+            break;
+        if (status == Z_STREAM_END || strm.avail_out != 0) {
+            B.ok = true;
+            break;
+        }
+        size_t used = B.data.size();
+        B.data.resize(2 * used);
+        strm.next_out = &B.data.front() + used;
+        strm.avail_out = B.data.size() - used;
+    }
+    B.data.resize(B.data.size() - strm.avail_out);
+    deflateEnd(&strm);
+}
+
+// Encodes in the style of pigz. The image is split into bands of rows. Each
+// round packs and filters one band per thread, then deflates them in
+// parallel and writes them before the next round, so only Threads bands are
+// held at a time. Each band is primed with the end of the previous one and
+// ends with a full flush, so bands form one zlib stream when concatenated.
+// Adler-32 values of bands are combined.
+static bool parallel_png(PNGSink& Sink, std::string& Error,
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    int ColorType, const PNGOptions& Options, size_t Threads)
+{
+    const size_t width = Image[0].size(), height = Image.size();
+    const size_t bpp = Image[0][0].size() * (Depth / 8);
+    const size_t row_size = width * bpp;
+    const int filters = (Options.filters < 0) ? PNG_ALL_FILTERS :
+        (Options.filters ? Options.filters : PNG_FILTER_NONE);
+    const int level =
+        (Options.level < 0) ? Z_DEFAULT_COMPRESSION : Options.level;
+    const int strategy =
+        (filters == PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    // Bands are at least half of band_bytes unless last, so the dictionary
+    // of a band comes from the previous band alone.
+    const size_t rows_per_band =
+        std::max(size_t(1), band_bytes / (row_size + 1));
+    const size_t band_count = (height + rows_per_band - 1) / rows_per_band;
+    const size_t window = 32768;
+    std::vector<Band> bands(std::min(Threads, band_count));
+    std::vector<unsigned char> previous; // End of the last band written.
+    Error = "Failed to write.";
+    std::vector<unsigned char> chunk;
+    const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    if (!Sink.Write(signature, 8))
+        return false;
+    put_u32(chunk, width);
+    put_u32(chunk, height);
+    chunk.push_back(Depth);
+    chunk.push_back(ColorType);
+    chunk.push_back(0); // Deflate.
+    chunk.push_back(0); // Adaptive filtering.
+    chunk.push_back(0); // No interlace.
+    if (!put_chunk(Sink, "IHDR", { Piece(chunk.data(), chunk.size()) }))
+        return false;
+    uLong adler = 1;
+    std::vector<unsigned char> suffix;
+    for (size_t first = 0; first < band_count; first += bands.size()) {
+        const size_t count = std::min(bands.size(), band_count - first);
+        for_each_parallel(count, Threads, [&](size_t k) {
+            size_t begin = (first + k) * rows_per_band;
+            filter_band(bands[k], Image, Depth, begin,
+                std::min(height, begin + rows_per_band), row_size, bpp,
+                filters);
+        });
+        for_each_parallel(count, Threads, [&](size_t k) {
+            const std::vector<unsigned char>& before =
+                k ? bands[k - 1].filtered : previous;
+            size_t dict = std::min(before.size(), window);
+            deflate_band(bands[k], before.data() + before.size() - dict, dict,
+                first + k + 1 == band_count, level, strategy);
+        });
+        for (size_t k = 0; k < count; ++k)
+            if (!bands[k].ok) {
+                Error = "Failed to compress.";
+                return false;
+            }
+        for (size_t k = 0; k < count; ++k) {
+            const Band& band(bands[k]);
+            adler = (first + k) ?
+                adler32_combine(adler, band.adler, band.filtered.size()) :
+                band.adler;
+            chunk.resize(0);
+            if (first + k == 0) {
+                int flevel = (level < 0 || level == 6) ? 2 :
+                    ((level < 2) ? 0 : ((level < 6) ? 1 : 3));
+                unsigned int header = 0x7800 | (flevel << 6);
+                header += 31 - header % 31;
+                chunk.push_back(header >> 8);
+                chunk.push_back(header & 0xff);
+            }
+            if (first + k + 1 == band_count)
+                put_u32(suffix, adler);
+            if (!put_chunk(Sink, "IDAT", { Piece(chunk.data(), chunk.size()),
+                Piece(band.data.data(), band.data.size()),
+                Piece(suffix.data(), suffix.size()) }))
+                return false;
+        }
+        const std::vector<unsigned char>& last = bands[count - 1].filtered;
+        size_t keep = std::min(last.size(), window);
+        previous.assign(last.end() - keep, last.end());
+    }
+    if (!put_chunk(Sink, "IEND", { }))
+        return false;
+    Error.clear();
+    return true;
+}
+
+bool PNGEncoder::Encode(
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    PNGSink& Sink, const PNGOptions& Options)
+{
+    error.clear();
     int color_type;
     switch (Image[0][0].size()) {
     case 1: color_type = PNG_COLOR_TYPE_GRAY; break;
     case 2: color_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
     case 3: color_type = PNG_COLOR_TYPE_RGB; break;
     case 4: color_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
+    default:
+        error = "Unsupported number of components.";
+        return false;
     }
-    png_set_IHDR(png.get(), info.get(), Image[0].size(), Image.size(), Depth,
-        color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
-        PNG_FILTER_TYPE_BASE);
-    png_write_info(png.get(), info.get());
-    std::vector<png_bytep> row_pointers;
-    row_pointers.reserve(Image.size());
     const size_t row_size = Image[0].size() * Image[0][0].size() * (Depth / 8);
-    Buffer<char> buf;
-    buf.reserve(Image.size() * row_size);
+    size_t threads = (0 < Options.threads) ?
+        Options.threads : std::thread::hardware_concurrency();
+    if (1 < threads && band_bytes < Image.size() * row_size) {
+        if (!parallel_png(Sink, error, Image, Depth, color_type, Options,
+            threads))
+            return false;
+    } else if (!serial_png(Sink, Image, Depth, color_type, row_size, Options))
+        return false;
+    if (!Sink.Flush()) {
+        error = "Failed to write.";
+        return false;
+    }
+    return true;
+}
+
+bool PNGEncoder::serial_png(PNGSink& Sink,
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    int ColorType, size_t RowSize, const PNGOptions& Options)
+{
+    WriteStructs structs(error);
+    png_structp png = structs.png;
+    if (!png || !structs.info) {
+        error = "Failed to create PNG structs.";
+        return false;
+    }
+    png_set_write_fn(png, reinterpret_cast<void*>(&Sink), append,
+        flush_nothing);
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+    png_set_IHDR(png, structs.info, Image[0].size(), Image.size(), Depth,
+        ColorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+        PNG_FILTER_TYPE_BASE);
+    if (0 <= Options.level)
+        png_set_compression_level(png, Options.level);
+    if (0 <= Options.filters)
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, Options.filters);
+    png_write_info(png, structs.info);
+    // Convert one row at a time so that only a row is held in addition to
+    // the image and the first row is compressed right away.
+    samples.resize(RowSize);
     for (auto& line : Image) {
-        for (auto& pixel : line)
-            if (Depth == 8)
-                for (auto& component : pixel)
-                    buf << static_cast<char>(
-                        static_cast<unsigned char>(component));
-            else
-                for (auto& component : pixel) {
-                    std::uint16_t val = static_cast<std::uint16_t>(component);
-                    buf << static_cast<char>((val >> 8) & 0xff)
-                        << static_cast<char>(val & 0xff);
-                }
-        if (!row_pointers.empty())
-            row_pointers.push_back(row_pointers.back() + row_size);
-        else
-            row_pointers.push_back(
-                reinterpret_cast<png_bytep>(&buf.front()));
+        pack_row(samples.data(), line, Depth);
+        png_write_row(png, samples.data());
     }
-    png_write_image(png.get(), &row_pointers.front());
-    png_write_end(png.get(), info.get());
+    png_write_end(png, structs.info);
+    return true;
+}
+
+std::vector<unsigned char> PNGEncoder::Encode(
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    const PNGOptions& Options)
+{
+    std::vector<unsigned char> out;
+    PNGBufferSink sink(out);
+    if (!Encode(Image, Depth, sink, Options))
+        out.clear();
     return out;
 }
 
+std::vector<unsigned char> memoryPNG(
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    const PNGOptions& Options)
+{
+    PNGEncoder encoder;
+    return encoder.Encode(Image, Depth, Options);
+}
+
 #endif
@@ -10,11 +10,101 @@
 #define MEMIMAGE_HPP
 
 #include <vector>
+#include <string>
+#include <functional>
+#include <cstddef>
 
 
+// PNG encoding settings. Negative values use libpng defaults.
+struct PNGOptions {
+    int level; // zlib compression level, 0 stores without compression.
+    int filters; // Combination of libpng PNG_FILTER_* flags.
+    int threads; // Bands encoded in parallel for large images, 0 per core.
+
+    PNGOptions() : level(-1), filters(-1), threads(0) { }
+};
+
 #if !defined(NO_PNG)
+// Sets options for "deflate" or "store". Store replaces level and filters set
+// earlier. Returns false for unknown name.
+bool pngCompression(const std::string& Name, PNGOptions& Options);
+// Sets filters for "none", "sub", "up", "average", "paeth" or "all".
+bool pngFilter(const std::string& Name, PNGOptions& Options);
+
+// Destination for encoded PNG data.
+class PNGSink {
+public:
+    virtual ~PNGSink() { }
+    // Returns false on failure, which stops encoding.
+    virtual bool Write(const unsigned char* Data, size_t Length) = 0;
+    // Called once after the last Write.
+    virtual bool Flush() { return true; }
+};
+
+// Writes to a file descriptor in blocks of Block bytes. Does not close Fd.
+class PNGFileSink : public PNGSink {
+private:
+    int fd;
+    std::vector<unsigned char> buffer;
+    size_t used;
+
+public:
+    PNGFileSink(int Fd, size_t Block = 1 << 20)
+        : fd(Fd), buffer(Block), used(0) { }
+    bool Write(const unsigned char* Data, size_t Length);
+    bool Flush();
+};
+
+// Appends to Out, growing capacity geometrically.
+class PNGBufferSink : public PNGSink {
+private:
+    std::vector<unsigned char>& out;
+
+public:
+    PNGBufferSink(std::vector<unsigned char>& Out) : out(Out) { }
+    bool Write(const unsigned char* Data, size_t Length);
+};
+
+// Passes data to Function.
+class PNGCallbackSink : public PNGSink {
+private:
+    std::function<bool(const unsigned char*, size_t)> function;
+
+public:
+    PNGCallbackSink(std::function<bool(const unsigned char*, size_t)> Function)
+        : function(Function) { }
+    bool Write(const unsigned char* Data, size_t Length) {
+        return function(Data, Length);
+    }
+};
+
+// Encodes images to PNG. There is no shared state so each thread can use an
+// encoder of its own. Buffers are kept for the next image. libpng does not
+// allow reusing a write struct so it is created for each image.
+class PNGEncoder {
+private:
+    std::vector<unsigned char> samples;
+    std::string error;
+
+    bool serial_png(PNGSink& Sink,
+        const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+        int ColorType, size_t RowSize, const PNGOptions& Options);
+
+public:
+    // Returns false on failure. Data written before failure stays in Sink.
+    bool Encode(
+        const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+        PNGSink& Sink, const PNGOptions& Options = PNGOptions());
+    // Returns empty vector on failure.
+    std::vector<unsigned char> Encode(
+        const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+        const PNGOptions& Options = PNGOptions());
+    const std::string& Error() const { return error; }
+};
+
 std::vector<unsigned char> memoryPNG(
-    const std::vector<std::vector<std::vector<float>>>& Image, int Depth);
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    const PNGOptions& Options = PNGOptions());
 #endif
 
 #endif
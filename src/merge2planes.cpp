@@ -0,0 +1,223 @@
+//
+//  merge2planes.cpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "merge2planes_io.hpp"
+#if defined(UNITTEST)
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+#else
+#include "convenience.hpp"
+#endif
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <cmath>
+#include <fstream>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <deque>
+
+typedef std::vector<std::vector<float>> Plane;
+
+// Planes in component order, Fields that are not null followed by Rest.
+static std::vector<const Plane*> in_order(const Plane* const* Fields,
+    size_t Count, const std::vector<Plane>* Rest)
+{
+    std::vector<const Plane*> planes;
+    for (size_t k = 0; k < Count && Fields[k]; ++k)
+        planes.push_back(Fields[k]);
+    for (size_t k = planes.size(); k < Count; ++k)
+        if (Fields[k])
+            throw "Planes must be given in order from plane0.";
+    if (Rest)
+        for (auto& plane : *Rest)
+            planes.push_back(&plane);
+    return planes;
+}
+
+// Returns the width shared by all rows of all planes.
+static size_t plane_width(const std::vector<const Plane*>& Planes) {
+    if (Planes.empty())
+        throw "No planes.";
+    const Plane& first(*Planes.front());
+    size_t width = first.empty() ? 0 : first.front().size();
+    for (auto plane : Planes) {
+        if (plane->size() != first.size())
+            throw "Plane height varies.";
+        for (auto& row : *plane)
+            if (row.size() != width)
+                throw "Plane width varies.";
+    }
+    return width;
+}
+
+// Stores N components of each pixel in Dest from rows Src[0] ... Src[N - 1].
+template<size_t N>
+static void merge_row(Plane& Dest, const float* const* Src) {
+    for (size_t k = 0; k < Dest.size(); ++k) {
+        float* pixel = Dest[k].data();
+        for (size_t c = 0; c < N; ++c)
+            pixel[c] = Src[c][k];
+    }
+}
+
+static void merge_row(Plane& Dest, const float* const* Src, size_t Count) {
+    for (size_t k = 0; k < Dest.size(); ++k) {
+        float* pixel = Dest[k].data();
+        for (size_t c = 0; c < Count; ++c)
+            pixel[c] = Src[c][k];
+    }
+}
+
+// Interleaves row Y of all planes into Dest, which has one vector of plane
+// count components per pixel.
+static void merge(Plane& Dest, const std::vector<const Plane*>& Planes,
+    size_t Y, std::vector<const float*>& Src)
+{
+    Src.resize(Planes.size());
+    for (size_t c = 0; c < Planes.size(); ++c)
+        Src[c] = (*Planes[c])[Y].data();
+    switch (Planes.size()) {
+    case 1: merge_row<1>(Dest, Src.data()); break;
+    case 2: merge_row<2>(Dest, Src.data()); break;
+    case 3: merge_row<3>(Dest, Src.data()); break;
+    case 4: merge_row<4>(Dest, Src.data()); break;
+    default: merge_row(Dest, Src.data(), Planes.size()); break;
+    }
+}
+
+#if !defined(UNITTEST)
+
+static int merge2planes(io::Merge2PlanesIn& Val) {
+    const Plane* fields[4] = {
+        Val.plane0Given() ? &Val.plane0() : nullptr,
+        Val.plane1Given() ? &Val.plane1() : nullptr,
+        Val.plane2Given() ? &Val.plane2() : nullptr,
+        Val.plane3Given() ? &Val.plane3() : nullptr };
+    std::vector<const Plane*> planes;
+    size_t width = 0;
+    try {
+        planes = in_order(fields, 4,
+            Val.planesGiven() ? &Val.planes() : nullptr);
+        width = plane_width(planes);
+    }
+    catch (const char* msg) {
+        std::cerr << msg << std::endl;
+        return 1;
+    }
+    // Rows are output as they are merged so the image is never held whole.
+    Plane row(width, std::vector<float>(planes.size()));
+    std::vector<const float*> src;
+    std::vector<char> buffer;
+    std::cout << "{\"image\":[";
+    for (size_t y = 0; y < planes.front()->size(); ++y) {
+        merge(row, planes, y, src);
+        if (y)
+            std::cout << ',';
+        io::Write(std::cout, row, buffer);
+    }
+    std::cout << "]}" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int f = 0;
+    if (argc > 1)
+        f = open(argv[1], O_RDONLY);
+    InputParser<io::ParserPool, io::Merge2PlanesIn_Parser, io::Merge2PlanesIn>
+        ip(f);
+    int status = ip.ReadAndParse(merge2planes);
+    if (f)
+        close(f);
+    return status;
+}
+
+#else
+
+static Plane test_plane(size_t Height, size_t Width, float Start) {
+    Plane plane(Height, std::vector<float>(Width));
+    for (auto& row : plane)
+        for (auto& value : row)
+            value = Start++;
+    return plane;
+}
+
+TEST_CASE("in_order") {
+    Plane a = test_plane(2, 2, 0.0f);
+    Plane b = test_plane(2, 2, 4.0f);
+    std::vector<Plane> rest;
+    rest.push_back(test_plane(2, 2, 8.0f));
+    SUBCASE("Fields then array") {
+        const Plane* fields[4] = { &a, &b, nullptr, nullptr };
+        std::vector<const Plane*> planes = in_order(fields, 4, &rest);
+        REQUIRE(planes.size() == 3);
+        REQUIRE(planes[0] == &a);
+        REQUIRE(planes[1] == &b);
+        REQUIRE(planes[2] == &rest[0]);
+    }
+    SUBCASE("Array only") {
+        const Plane* fields[4] = { nullptr, nullptr, nullptr, nullptr };
+        std::vector<const Plane*> planes = in_order(fields, 4, &rest);
+        REQUIRE(planes.size() == 1);
+        REQUIRE(planes[0] == &rest[0]);
+    }
+    SUBCASE("Gap") {
+        const Plane* fields[4] = { &a, nullptr, &b, nullptr };
+        REQUIRE_THROWS_AS(in_order(fields, 4, nullptr), const char*);
+    }
+}
+
+TEST_CASE("plane_width") {
+    Plane a = test_plane(3, 4, 0.0f);
+    SUBCASE("None") {
+        std::vector<const Plane*> planes;
+        REQUIRE_THROWS_AS(plane_width(planes), const char*);
+    }
+    SUBCASE("All same") {
+        Plane b = test_plane(3, 4, 12.0f);
+        std::vector<const Plane*> planes = { &a, &b };
+        REQUIRE(plane_width(planes) == 4);
+    }
+    SUBCASE("Height mismatch") {
+        Plane b = test_plane(2, 4, 12.0f);
+        std::vector<const Plane*> planes = { &a, &b };
+        REQUIRE_THROWS_AS(plane_width(planes), const char*);
+    }
+    SUBCASE("Width mismatch") {
+        Plane b = test_plane(3, 4, 12.0f);
+        b.back().push_back(0.0f);
+        std::vector<const Plane*> planes = { &a, &b };
+        REQUIRE_THROWS_AS(plane_width(planes), const char*);
+    }
+}
+
+TEST_CASE("merge") {
+    SUBCASE("Inverse of split") {
+        // Fixed counts 1 to 4 and the general case.
+        for (size_t count = 1; count < 7; ++count) {
+            std::vector<Plane> source;
+            for (size_t c = 0; c < count; ++c)
+                source.push_back(test_plane(3, 5, 100.0f * c));
+            std::vector<const Plane*> planes;
+            for (auto& plane : source)
+                planes.push_back(&plane);
+            Plane row(5, std::vector<float>(count));
+            std::vector<const float*> src;
+            for (size_t y = 0; y < 3; ++y) {
+                merge(row, planes, y, src);
+                for (size_t x = 0; x < 5; ++x)
+                    for (size_t c = 0; c < count; ++c)
+                        REQUIRE(row[x][c] == source[c][y][x]);
+            }
+        }
+    }
+}
+
+#endif
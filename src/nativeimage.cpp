@@ -0,0 +1,92 @@
+//
+//  nativeimage.cpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "nativeimage.hpp"
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cstring>
+
+
+static const char magic[8] = { 'N', 'A', 'T', 'I', 'V', 'I', 'M', 'G' };
+static const std::uint32_t version = 1;
+static const std::uint32_t byte_order = 0x01020304;
+static const std::uint32_t alignment = 4096;
+static_assert(sizeof(NativeHeader) == 64, "Header layout has padding.");
+
+static size_t sample_size(std::uint32_t Sample) {
+    switch (Sample) {
+    case NativeUInt8: return 1;
+    case NativeUInt16: return 2;
+    case NativeFloat32: return 4;
+    }
+    return 0;
+}
+
+bool nativeMagic(const void* Head, size_t Length) {
+    return sizeof(magic) <= Length && memcmp(Head, magic, sizeof(magic)) == 0;
+}
+
+bool nativeHeader(NativeHeader& Header,
+    size_t Height, size_t Width, size_t Components, NativeSample Sample)
+{
+    memset(&Header, 0, sizeof(Header));
+    if (!Height || !Width || !Components || 0xffffffffu < Height ||
+        0xffffffffu < Width || 0xffffffffu < Components)
+            return false;
+    memcpy(Header.magic, magic, sizeof(magic));
+    Header.version = version;
+    Header.byte_order = byte_order;
+    Header.height = Height;
+    Header.width = Width;
+    Header.components = Components;
+    Header.sample = Sample;
+    Header.stride = (Width * Components * sample_size(Sample) + 15) &
+        ~std::uint64_t(15);
+    Header.data = alignment;
+    Header.alignment = alignment;
+    return true;
+}
+
+int nativeCheck(const NativeHeader& Header, size_t Size) {
+    if (memcmp(Header.magic, magic, sizeof(magic)) != 0)
+        return -1;
+    if (Header.byte_order != byte_order)
+        return -2;
+    size_t bytes = sample_size(Header.sample);
+    if (Header.version != version || !bytes || !Header.height ||
+        !Header.width || !Header.components || Header.alignment == 0 ||
+        Header.data < sizeof(Header) || Header.data % Header.alignment ||
+        Header.stride % 16 ||
+        Header.stride < std::uint64_t(Header.width) * Header.components * bytes)
+            return -3;
+    if (Size < Header.data || (Size - Header.data) / Header.stride <
+        Header.height || Size - Header.data != Header.height * Header.stride)
+            return -3;
+    return 0;
+}
+
+NativeImage::~NativeImage() {
+    if (base)
+        munmap(const_cast<unsigned char*>(base), size);
+}
+
+int NativeImage::Map(int Fd) {
+    struct stat info;
+    if (fstat(Fd, &info) == -1 || info.st_size < off_t(sizeof(header)))
+        return -1;
+    void* map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (map == MAP_FAILED)
+        return -4;
+    base = reinterpret_cast<const unsigned char*>(map);
+    size = info.st_size;
+    memcpy(&header, base, sizeof(header));
+    int status = nativeCheck(header, size);
+    if (status == 0)
+        madvise(map, size, MADV_SEQUENTIAL);
+    return status;
+}
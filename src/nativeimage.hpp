@@ -0,0 +1,83 @@
+//
+//  nativeimage.hpp
+//
+//  Created by Ismo Kärkkäinen on 16.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Native image container for passing images between these programs without
+// conversion. Fixed header followed by rows of samples in host byte order:
+//
+// offset  size  contents
+//  0      8     "NATIVIMG"
+//  8      4     version, 1
+// 12      4     0x01020304 in byte order of the samples
+// 16      4     height
+// 20      4     width
+// 24      4     components
+// 28      4     sample type, 1 uint8, 2 uint16, 3 float32
+// 32      8     row stride in bytes, multiple of 16
+// 40      8     offset of first row, multiple of alignment
+// 48      4     alignment, 4096
+// 52      12    zeros
+//
+// Components of a pixel are consecutive. Rows are padded with zeros to the
+// stride. File size is data offset + height * stride, so the file can be
+// mapped and rows used in place.
+
+#if !defined(NATIVEIMAGE_HPP)
+#define NATIVEIMAGE_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+
+enum NativeSample {
+    NativeUInt8 = 1,
+    NativeUInt16 = 2,
+    NativeFloat32 = 3
+};
+
+struct NativeHeader {
+    char magic[8];
+    std::uint32_t version, byte_order, height, width, components, sample;
+    std::uint64_t stride, data;
+    std::uint32_t alignment;
+    char reserved[12];
+};
+
+// Returns true if Head starts with the magic.
+bool nativeMagic(const void* Head, size_t Length);
+
+// Fills Header for image of given size. Returns false if size is zero or
+// too large.
+bool nativeHeader(NativeHeader& Header,
+    size_t Height, size_t Width, size_t Components, NativeSample Sample);
+
+// Returns 0 if Header is valid for file of Size bytes, -1 if not a native
+// image, -2 if byte order differs from host and -3 for invalid contents.
+int nativeCheck(const NativeHeader& Header, size_t Size);
+
+// Read-only mapping of a native image file.
+class NativeImage {
+private:
+    const unsigned char* base;
+    size_t size;
+
+public:
+    NativeHeader header;
+
+    NativeImage() : base(nullptr), size(0) { }
+    ~NativeImage();
+
+    // Maps the file open as Fd, which can be closed afterwards. Returns
+    // nativeCheck status or -4 if mapping fails.
+    int Map(int Fd);
+
+    const unsigned char* Row(size_t Y) const {
+        return base + header.data + Y * header.stride;
+    }
+};
+
+#endif
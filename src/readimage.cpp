@@ -7,6 +7,8 @@
 // Licensed under Universal Permissive License. See License.txt.
 
 #include "convenience.hpp"
+#include "imagecache.hpp"
+#include "nativeimage.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
@@ -17,6 +19,18 @@
 #include <cstddef>
 #include <iterator>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <glob.h>
 #if !defined(NO_TIFF)
 #include <stdio.h>
 #include <tiffio.h>
@@ -32,179 +46,634 @@ typedef std::vector<std::vector<std::vector<float>>> Image;
 #include "readimage_io.hpp"
 
 
-int read_whole_file(std::vector<std::byte>& Contents, const char* Filename) {
-    int fd = open(Filename, O_RDONLY | O_CLOEXEC);
-    if (fd == -1)
-        return -1;
-    struct stat info;
-    if (-1 == fstat(fd, &info)) {
-        close(fd);
-        return -2;
+// Opened image file. The first block read is used for format detection and
+// kept so that readers that need the whole file do not read it twice.
+
+class ImageFile {
+private:
+    int fd;
+    size_t size;
+
+public:
+    static const size_t head_size = 65536;
+    const io::ReadImageIn::filenameType& filename;
+    std::vector<std::byte> contents;
+    std::string error; // Message from decoder library.
+
+    ImageFile(const io::ReadImageIn::filenameType& Filename)
+        : fd(-1), size(0), filename(Filename) { }
+    ~ImageFile() {
+        if (fd != -1)
+            close(fd);
     }
-    Contents.resize(info.st_size);
-    int got = read(fd, &Contents.front(), info.st_size);
-    close(fd);
-    return Contents.size() - got;
-}
 
+    // Returns -1 if open fails, -2 if getting size fails, -3 if reading fails.
+    int Open() {
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return -1;
+        struct stat info;
+        if (-1 == fstat(fd, &info))
+            return -2;
+        size = info.st_size;
+        contents.resize((size < head_size) ? size : head_size);
+        return read_into(0) ? 0 : -3;
+    }
+
+    // Returns false if the whole file could not be read.
+    bool ReadAll() {
+        if (contents.size() == size)
+            return true;
+        size_t got = contents.size();
+        contents.resize(size);
+        return read_into(got);
+    }
+
+    int Descriptor() const { return fd; }
+
+    // Hands the descriptor, positioned at start, over to a library.
+    int Release() {
+        int d = fd;
+        fd = -1;
+        if (d != -1)
+            lseek(d, 0, SEEK_SET);
+        return d;
+    }
+
+private:
+    bool read_into(size_t Offset) {
+        while (Offset < contents.size()) {
+            errno = 0;
+            ssize_t count = read(fd, &contents[Offset], contents.size() - Offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+            Offset += count;
+        }
+        return Offset == contents.size();
+    }
+};
+
+// Components to output. Readers map the selection to components in the file
+// once the component count is known.
+
+class Selection {
+public:
+    std::vector<size_t> channels; // Empty selects all.
+    size_t page;
+    uint64_t offset; // Location of page in file, 0 if not known.
+
+    Selection() : page(0), offset(0) { }
+
+    // Returns false if a selected component is not present.
+    bool Map(std::vector<size_t>& Index, size_t Components) const {
+        Index.resize(0);
+        if (channels.empty())
+            for (size_t k = 0; k < Components; ++k)
+                Index.push_back(k);
+        else
+            for (size_t c : channels) {
+                if (Components <= c)
+                    return false;
+                Index.push_back(c);
+            }
+        return true;
+    }
+};
+
+// Called with height, width and components when the size of an image being
+// read is known, before it is allocated.
+typedef std::function<void(size_t, size_t, size_t)> SizeHook;
+
+// Destination of values read. Interleaved layout is height * width *
+// components and planar layout is components * height * width. Readers give
+// values one row at a time so that layout is decided while reading.
+
+class Raster {
+private:
+    Image& image;
+    size_t width, components;
+    const SizeHook* hook; // Null if size is not reported.
+
+public:
+    const bool planar;
+
+    Raster(Image& I, bool Planar, const SizeHook* Hook)
+        : image(I), width(0), components(0), hook(Hook), planar(Planar) { }
+
+    void Resize(size_t Height, size_t Width, size_t Components) {
+        if (hook)
+            (*hook)(Height, Width, Components);
+        width = Width;
+        components = Components;
+        if (planar) {
+            image.resize(components);
+            for (auto& plane : image) {
+                plane.resize(Height);
+                for (auto& line : plane)
+                    line.resize(width);
+            }
+        } else {
+            image.resize(Height);
+            for (auto& line : image) {
+                line.resize(width);
+                for (auto& pixel : line)
+                    pixel.resize(components);
+            }
+        }
+    }
+
+    // Value(column, component) returns the value to store.
+    template<typename ValueFunc>
+    void SetRow(size_t Row, ValueFunc Value) {
+        if (planar)
+            for (size_t c = 0; c < components; ++c) {
+                std::vector<float>& line = image[c][Row];
+                for (size_t x = 0; x < width; ++x)
+                    line[x] = Value(x, c);
+            }
+        else {
+            std::vector<std::vector<float>>& line = image[Row];
+            for (size_t x = 0; x < width; ++x) {
+                std::vector<float>& pixel = line[x];
+                for (size_t c = 0; c < components; ++c)
+                    pixel[c] = Value(x, c);
+            }
+        }
+    }
 
-typedef const char* (*ReadFunc)(const io::ReadImageIn::filenameType&, Image&);
+    // Value(column) returns the value to store. Different components can be
+    // set concurrently.
+    template<typename ValueFunc>
+    void SetComponentRow(size_t Row, size_t Component, ValueFunc Value) {
+        if (planar) {
+            std::vector<float>& line = image[Component][Row];
+            for (size_t x = 0; x < width; ++x)
+                line[x] = Value(x);
+        } else {
+            std::vector<std::vector<float>>& line = image[Row];
+            for (size_t x = 0; x < width; ++x)
+                line[x][Component] = Value(x);
+        }
+    }
+};
+
+typedef const char* (*ReadFunc)(ImageFile&, const Selection&, Raster&);
 
 #if !defined(NO_TIFF)
-static std::string tiff_error;
+// libtiff 4.5 and later pass a per-handle pointer to error handlers.
+#if defined(TIFFLIB_VERSION) && 20221213 <= TIFFLIB_VERSION
+#define TIFF_OPEN_OPTIONS
+#endif
 
-static void handle_tiff_error(const char* module, const char* fmt, va_list ap) {
+static void format_tiff_error(std::string& Error,
+    const char* module, const char* fmt, va_list ap)
+{
     std::vector<char> buffer;
     buffer.resize(256);
-    tiff_error = module;
-    tiff_error += ": ";
+    Error = module ? module : "";
+    Error += ": ";
+    va_list copy;
 retry:
-    int status = vsnprintf(&buffer.front(), buffer.size(), fmt, ap);
+    va_copy(copy, ap);
+    int status = vsnprintf(&buffer.front(), buffer.size(), fmt, copy);
+    va_end(copy);
     if (static_cast<int>(buffer.size()) <= status) {
         buffer.resize(status + 1);
         goto retry;
     }
     if (status < 0)
-        tiff_error += "Failed to print.";
+        Error += "Failed to print.";
     else
-        tiff_error += &buffer.front();
+        Error += &buffer.front();
 }
 
-static int read_tiff(
-    const io::ReadImageIn::filenameType& filename, Image& image)
+#if defined(TIFF_OPEN_OPTIONS)
+static int handle_tiff_error(TIFF* unused, void* Error,
+    const char* module, const char* fmt, va_list ap)
+{
+    format_tiff_error(*reinterpret_cast<std::string*>(Error), module, fmt, ap);
+    return 1;
+}
+
+static int handle_tiff_warning(TIFF* unused, void* unused2,
+    const char* unused3, const char* unused4, va_list unused5)
+{
+    return 1;
+}
+#else
+// Older libtiff has only process-wide handlers. Messages go to the string of
+// the handle last opened in the thread.
+static thread_local std::string* tiff_error = nullptr;
+
+static void handle_tiff_error(const char* module, const char* fmt, va_list ap) {
+    if (tiff_error)
+        format_tiff_error(*tiff_error, module, fmt, ap);
+}
+#endif
+
+// Opens by Fd, or by Filename if Fd is negative. Errors go to Error.
+static TIFF* open_tiff(int Fd, const std::string& Filename,
+    std::string& Error)
 {
+#if defined(TIFF_OPEN_OPTIONS)
+    TIFFOpenOptions* options = TIFFOpenOptionsAlloc();
+    TIFFOpenOptionsSetErrorHandlerExtR(options, &handle_tiff_error, &Error);
+    TIFFOpenOptionsSetWarningHandlerExtR(options, &handle_tiff_warning, nullptr);
+    TIFF* t = (Fd < 0) ? TIFFOpenExt(Filename.c_str(), "r", options) :
+        TIFFFdOpenExt(Fd, Filename.c_str(), "r", options);
+    TIFFOpenOptionsFree(options);
+    return t;
+#else
     TIFFSetWarningHandler(NULL);
     TIFFSetErrorHandler(&handle_tiff_error);
-    TIFF* t = TIFFOpen(filename.c_str(), "r");
-    if (t == nullptr)
+    tiff_error = &Error;
+    return (Fd < 0) ? TIFFOpen(Filename.c_str(), "r") :
+        TIFFFdOpen(Fd, Filename.c_str(), "r");
+#endif
+}
+
+static bool is_tiff(const std::vector<std::byte>& Head) {
+    // Classic TIFF has 42 as version, BigTIFF 43.
+    if (Head.size() < 4)
+        return false;
+    unsigned char c[4];
+    memcpy(c, &Head.front(), 4);
+    if (c[0] == 'I' && c[1] == 'I')
+        return c[3] == 0 && (c[2] == 42 || c[2] == 43);
+    if (c[0] == 'M' && c[1] == 'M')
+        return c[2] == 0 && (c[3] == 42 || c[3] == 43);
+    return false;
+}
+
+// Half precision floating point value as stored in file.
+struct Half {
+    std::uint16_t bits;
+};
+
+static float sample_value(std::uint8_t V) { return float(V); }
+static float sample_value(std::uint16_t V) { return float(V); }
+static float sample_value(std::uint32_t V) { return float(V); }
+static float sample_value(float V) { return V; }
+
+static float sample_value(Half V) {
+    std::uint32_t sign = std::uint32_t(V.bits & 0x8000) << 16;
+    std::uint32_t exponent = (V.bits >> 10) & 0x1f;
+    std::uint32_t mantissa = V.bits & 0x3ff;
+    if (exponent == 0) {
+        float value = std::ldexp(float(mantissa), -24);
+        return sign ? -value : value;
+    }
+    std::uint32_t bits = sign | (mantissa << 13);
+    if (exponent == 0x1f)
+        bits |= 0x7f800000;
+    else
+        bits |= (exponent + 112) << 23;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+enum SampleType { SampleU8, SampleU16, SampleU32, SampleF16, SampleF32 };
+
+// Calls Func with a value of the type that matches Type.
+template<typename Func>
+static void for_sample_type(SampleType Type, Func F) {
+    switch (Type) {
+    case SampleU8: F(std::uint8_t()); break;
+    case SampleU16: F(std::uint16_t()); break;
+    case SampleU32: F(std::uint32_t()); break;
+    case SampleF16: F(Half()); break;
+    case SampleF32: F(float()); break;
+    }
+}
+
+static int read_tiff_contig(TIFF* t, const std::vector<size_t>& index,
+    SampleType type, uint16 samples, uint32 height, Raster& image)
+{
+    std::unique_ptr<void,void (*)(void*)> buffer(
+        _TIFFmalloc(TIFFScanlineSize(t)), &_TIFFfree);
+    int status = 0;
+    for_sample_type(type, [&](auto sample) {
+        typedef decltype(sample) T;
+        const T* curr = reinterpret_cast<const T*>(buffer.get());
+        for (uint32 row = 0; row < height; ++row) {
+            if (-1 == TIFFReadScanline(t, buffer.get(), row)) {
+                status = -4;
+                return;
+            }
+            image.SetRow(row, [&](size_t x, size_t c) {
+                return sample_value(curr[x * samples + index[c]]); });
+        }
+    });
+    return status;
+}
+
+// Reads a row of tiles at a time and sets image rows from them.
+static int read_tiff_tiled(TIFF* t, const std::vector<size_t>& index,
+    SampleType type, uint16 samples, uint32 width, uint32 height,
+    Raster& image)
+{
+    uint32 tile_width = 0, tile_height = 0;
+    TIFFGetField(t, TIFFTAG_TILEWIDTH, &tile_width);
+    TIFFGetField(t, TIFFTAG_TILELENGTH, &tile_height);
+    if (tile_width == 0 || tile_height == 0)
+        return -7;
+    const size_t across = (width + tile_width - 1) / tile_width;
+    const tmsize_t tile_size = TIFFTileSize(t);
+    std::unique_ptr<void,void (*)(void*)> buffer(
+        _TIFFmalloc(across * tile_size), &_TIFFfree);
+    unsigned char* tiles = reinterpret_cast<unsigned char*>(buffer.get());
+    int status = 0;
+    for_sample_type(type, [&](auto sample) {
+        typedef decltype(sample) T;
+        for (uint32 top = 0; top < height; top += tile_height) {
+            for (size_t k = 0; k < across; ++k)
+                if (-1 == TIFFReadEncodedTile(t,
+                    TIFFComputeTile(t, k * tile_width, top, 0, 0),
+                    tiles + k * tile_size, tile_size))
+                {
+                    status = -4;
+                    return;
+                }
+            uint32 rows = std::min(tile_height, height - top);
+            for (uint32 r = 0; r < rows; ++r)
+                image.SetRow(top + r, [&](size_t x, size_t c) {
+                    size_t k = x / tile_width;
+                    const T* curr = reinterpret_cast<const T*>(
+                        tiles + k * tile_size) + r * tile_width * samples;
+                    return sample_value(
+                        curr[(x - k * tile_width) * samples + index[c]]); });
+        }
+    });
+    return status;
+}
+
+static int read_tiff_plane(TIFF* t, size_t sample, size_t component,
+    SampleType type, uint16 bits, uint32 width, uint32 height, Raster& image)
+{
+    uint32 rows_per_strip = height;
+    TIFFGetFieldDefaulted(t, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    if (rows_per_strip == 0 || height < rows_per_strip)
+        rows_per_strip = height;
+    std::unique_ptr<void,void (*)(void*)> buffer(
+        _TIFFmalloc(TIFFStripSize(t)), &_TIFFfree);
+    const size_t row_size = width * (bits / 8);
+    int status = 0;
+    for_sample_type(type, [&](auto value) {
+        typedef decltype(value) T;
+        for (uint32 row = 0; row < height; row += rows_per_strip) {
+            if (-1 == TIFFReadEncodedStrip(t,
+                TIFFComputeStrip(t, row, sample), buffer.get(), -1))
+            {
+                status = -4;
+                return;
+            }
+            uint32 rows = std::min(rows_per_strip, height - row);
+            for (uint32 r = 0; r < rows; ++r) {
+                const T* curr = reinterpret_cast<const T*>(
+                    reinterpret_cast<unsigned char*>(buffer.get()) +
+                        r * row_size);
+                image.SetComponentRow(row + r, component, [&](size_t x) {
+                    return sample_value(curr[x]); });
+            }
+        }
+    });
+    return status;
+}
+
+// Moves to the selected page, directly if the directory offset is known.
+
+static bool select_page(TIFF* t, const Selection& selection) {
+    if (selection.offset != 0)
+        return TIFFSetSubDirectory(t, selection.offset) != 0;
+    return selection.page == 0 || TIFFSetDirectory(t, selection.page) != 0;
+}
+
+// Planes are read in parallel. A TIFF handle can not be shared between
+// threads so each thread other than the caller opens the file again. If that
+// fails, the remaining threads read the planes.
+
+static int read_tiff_separate(TIFF* t, const std::string& filename,
+    const Selection& selection, const std::vector<size_t>& index,
+    SampleType type, uint16 bits, uint32 width, uint32 height, Raster& image,
+    std::string& Error)
+{
+    size_t workers = std::thread::hardware_concurrency();
+    if (workers == 0)
+        workers = 1;
+    if (index.size() < workers)
+        workers = index.size();
+    std::atomic<size_t> next(0);
+    std::vector<int> status(workers, 0);
+    std::vector<std::string> errors(workers);
+    auto work = [&](size_t w, TIFF* handle) {
+        for (size_t k = next++; k < index.size(); k = next++) {
+            status[w] = read_tiff_plane(
+                handle, index[k], k, type, bits, width, height, image);
+            if (status[w]) {
+                next = index.size();
+                break;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w)
+        pool.push_back(std::thread([&, w]() {
+            TIFF* handle = open_tiff(-1, filename, errors[w]);
+            if (!handle)
+                return;
+            if (select_page(handle, selection))
+                work(w, handle);
+            TIFFClose(handle);
+        }));
+    work(0, t);
+    for (auto& thread : pool)
+        thread.join();
+    // The caller reads using t and its errors are already in Error.
+    for (size_t w = 0; w < workers; ++w)
+        if (status[w]) {
+            if (w)
+                Error = errors[w];
+            return status[w];
+        }
+    return 0;
+}
+
+static int read_tiff(
+    ImageFile& file, const Selection& selection, Raster& image)
+{
+    int fd = file.Release();
+    TIFF* t = open_tiff(fd, file.filename, file.error);
+    if (t == nullptr) {
+        close(fd);
         return -1;
-    uint16 bits, samples;
+    }
+    if (!select_page(t, selection)) {
+        TIFFClose(t);
+        return -6;
+    }
+    uint16 bits, samples, format = SAMPLEFORMAT_UINT;
     uint32 width, height;
     TIFFGetField(t, TIFFTAG_BITSPERSAMPLE, &bits);
-    if (bits != 8 && bits != 16) {
+    TIFFGetFieldDefaulted(t, TIFFTAG_SAMPLEFORMAT, &format);
+    SampleType type;
+    if (format == SAMPLEFORMAT_UINT && bits == 8)
+        type = SampleU8;
+    else if (format == SAMPLEFORMAT_UINT && bits == 16)
+        type = SampleU16;
+    else if (format == SAMPLEFORMAT_UINT && bits == 32)
+        type = SampleU32;
+    else if (format == SAMPLEFORMAT_IEEEFP && bits == 16)
+        type = SampleF16;
+    else if (format == SAMPLEFORMAT_IEEEFP && bits == 32)
+        type = SampleF32;
+    else {
         TIFFClose(t);
         return -2;
     }
     TIFFGetField(t, TIFFTAG_SAMPLESPERPIXEL, &samples);
     TIFFGetField(t, TIFFTAG_IMAGEWIDTH, &width);
     TIFFGetField(t, TIFFTAG_IMAGELENGTH, &height);
+    uint16 config = PLANARCONFIG_CONTIG;
     if (samples != 1) {
-        uint16 config;
         TIFFGetField(t, TIFFTAG_PLANARCONFIG, &config);
-        if (config != PLANARCONFIG_CONTIG) {
+        if (config != PLANARCONFIG_CONTIG && config != PLANARCONFIG_SEPARATE) {
             TIFFClose(t);
             return -3;
         }
     }
-    std::unique_ptr<void,void (*)(void*)> buffer(
-        _TIFFmalloc(TIFFScanlineSize(t)), &_TIFFfree);
-    image.resize(height);
-    uint32 row = 0;
-    for (auto& line : image) {
-        line.resize(width);
-        if (-1 == TIFFReadScanline(t, buffer.get(), row++))
-            return -4;
-        unsigned char* curr = reinterpret_cast<unsigned char*>(buffer.get());
-        for (auto& pixel : line) {
-            pixel.resize(samples);
-            for (auto& component : pixel)
-                if (bits == 8)
-                    component = float(*curr++);
-                else {
-                    component = float(*reinterpret_cast<std::uint16_t*>(curr));
-                    curr += 2;
-                }
-        }
+    bool tiled = TIFFIsTiled(t) != 0;
+    if (tiled && config != PLANARCONFIG_CONTIG) {
+        TIFFClose(t);
+        return -3;
+    }
+    std::vector<size_t> index;
+    if (!selection.Map(index, samples)) {
+        TIFFClose(t);
+        return -5;
     }
+    image.Resize(height, width, index.size());
+    int status;
+    if (tiled)
+        status = read_tiff_tiled(t, index, type, samples, width, height, image);
+    else if (config == PLANARCONFIG_CONTIG)
+        status = read_tiff_contig(t, index, type, samples, height, image);
+    else
+        status = read_tiff_separate(t, file.filename, selection,
+            index, type, bits, width, height, image, file.error);
     TIFFClose(t);
-    return 0;
+    return status;
 }
 
 static const char* readTIFF(
-    const io::ReadImageIn::filenameType& filename, Image& image)
+    ImageFile& file, const Selection& selection, Raster& image)
 {
-    int status = read_tiff(filename, image);
+    int status = read_tiff(file, selection, image);
     switch (status) {
     case 0: return nullptr;
     case -1: return "Failed to open file.";
-    case -2: return "Unsupported bit depth.";
-    case -3: return "Not contiguous planar configuration.";
-    case -4: return tiff_error.c_str();
+    case -2: return "Unsupported sample format or bit depth.";
+    case -3: return "Unsupported planar configuration.";
+    case -4: return file.error.c_str();
+    case -5: return "Selected component not in image.";
+    case -6: return "Page not in image.";
+    case -7: return "Invalid tile size.";
     }
     return "Unspecified error.";
 }
+
+// Walks the directory chain once so that pages can be read from offsets.
+
+static int pagesTIFF(ImageFile& file, std::vector<uint64_t>& Offsets) {
+    TIFF* t = open_tiff(-1, file.filename, file.error);
+    if (t == nullptr)
+        return -1;
+    do
+        Offsets.push_back(TIFFCurrentDirOffset(t));
+    while (TIFFReadDirectory(t));
+    TIFFClose(t);
+    return static_cast<int>(Offsets.size());
+}
 #endif
 
 #if !defined(NO_PNG)
-static void png_error_handler(png_structp unused, const char* error) {
-    throw error;
-}
+static void png_error_handler(png_structp png, const char* error);
 
 static void png_warning_handler(png_structp unused, const char* unused2) { }
 
-typedef void (*png_destroyer)(png_structp);
-static void destroy_png(png_structp p) {
-    png_destroy_read_struct(&p, nullptr, nullptr);
-}
+// Owns libpng read and info structs for one image.
+class ReadStructs {
+public:
+    png_structp png;
+    png_infop info;
 
-typedef void (*info_destroyer)(png_infop);
-static png_structp png_s = nullptr;
-static void destroy_info(png_infop p) {
-    png_destroy_info_struct(png_s, &p);
-}
+    ReadStructs(void* ErrorPtr) : png(nullptr), info(nullptr) {
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, ErrorPtr,
+            &png_error_handler, &png_warning_handler);
+        if (png)
+            info = png_create_info_struct(png);
+    }
 
-static std::string png_error_message;
+    ~ReadStructs() {
+        if (png)
+            png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+    }
+};
 
 static void info_relay(png_structp png, png_infop info);
 static void row_relay(png_structp png, png_bytep buffer,
     png_uint_32 row, int pass);
 static void end_relay(png_structp png, png_infop info);
 
+static bool is_png(const std::vector<std::byte>& Head) {
+    return 8 <= Head.size() &&
+        png_sig_cmp(reinterpret_cast<png_const_bytep>(&Head.front()), 0, 8) == 0;
+}
+
 class ReadPNG {
 private:
-    const io::ReadImageIn::filenameType& filename;
-    Image& image;
-    std::vector<std::byte> contents;
+    ImageFile& file;
+    const Selection& selection;
+    Raster& image;
+    std::vector<size_t> index;
     png_uint_32 width, height;
     int passes, channels, bytes;
+    int status; // Returned when libpng jumps back.
     std::vector<std::unique_ptr<png_byte>> raw;
 
-    int read() {
-        int status = read_whole_file(contents, filename.c_str());
-        if (status != 0)
-            return status;
-        std::unique_ptr<png_struct,png_destroyer> png(
-            png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr,
-                &png_error_handler, &png_warning_handler),
-            &destroy_png);
-        png_s = png.get();
-        std::unique_ptr<png_info,info_destroyer> info(
-            png_create_info_struct(png.get()), &destroy_info);
-        png_set_progressive_read_fn(
-            png.get(), this, &info_relay, &row_relay, &end_relay);
-        if (setjmp(png_jmpbuf(png.get())))
-            return -4;
-        png_process_data(png.get(), info.get(),
-            reinterpret_cast<png_bytep>(&contents.front()), contents.size());
-        return 0;
+    void fail(png_structp png, int Status) {
+        status = Status;
+        png_longjmp(png, 1);
     }
 
 public:
-    ReadPNG(const io::ReadImageIn::filenameType& Filename, Image& I)
-        : filename(Filename), image(I),
-        width(0), height(0), passes(1), channels(0), bytes(0) { }
+    ReadPNG(ImageFile& File, const Selection& S, Raster& I)
+        : file(File), selection(S), image(I),
+        width(0), height(0), passes(1), channels(0), bytes(0), status(-3) { }
 
     int Read() {
-        try {
-            return read();
-        }
-        catch (const char* e) {
-            png_error_message = e;
-            return -3;
-        }
-        catch (const int e) {
-            return e;
-        }
+        if (selection.page != 0)
+            return -6;
+        if (!file.ReadAll())
+            return 1;
+        ReadStructs structs(this);
+        if (!structs.png || !structs.info)
+            return -7;
+        png_set_progressive_read_fn(
+            structs.png, this, &info_relay, &row_relay, &end_relay);
+        if (setjmp(png_jmpbuf(structs.png)))
+            return status;
+        png_process_data(structs.png, structs.info,
+            reinterpret_cast<png_bytep>(&file.contents.front()),
+            file.contents.size());
+        return 0;
+    }
+
+    void Error(png_structp png, const char* Message) {
+        file.error = Message;
+        fail(png, -3);
     }
 
     void info_callback(png_structp png, png_infop info) {
@@ -239,8 +708,10 @@ public:
             break;
         case PNG_COLOR_TYPE_RGB_ALPHA: channels = 4; break;
         default:
-            throw -4;
+            fail(png, -4);
         }
+        if (!selection.Map(index, channels))
+            fail(png, -5);
         if (interlace_type != PNG_INTERLACE_NONE)
             passes = png_set_interlace_handling(png);
         png_read_update_info(png, info);
@@ -257,26 +728,26 @@ public:
     }
 
     void end_callback(png_structp png, png_infop info) {
-        image.resize(height);
-        size_t k = 0;
-        for (auto& line : image) {
-            line.resize(width);
-            png_bytep curr = raw[k].get();
-            for (auto& pixel : line) {
-                pixel.resize(channels);
-                for (auto& component : pixel)
-                    if (bytes == 1)
-                        component = float(*curr++);
-                    else {
-                        component = (float(curr[0]) * 256.0f) + float(curr[1]);
-                        curr += 2;
-                    }
-            }
-            raw[k++].reset();
+        image.Resize(height, width, index.size());
+        for (png_uint_32 k = 0; k < height; ++k) {
+            const png_byte* curr = raw[k].get();
+            if (bytes == 1)
+                image.SetRow(k, [&](size_t x, size_t c) {
+                    return float(curr[x * channels + index[c]]); });
+            else
+                image.SetRow(k, [&](size_t x, size_t c) {
+                    const png_byte* v = curr + 2 * (x * channels + index[c]);
+                    return (float(v[0]) * 256.0f) + float(v[1]); });
+            raw[k].reset();
         }
     }
 };
 
+static void png_error_handler(png_structp png, const char* error) {
+    ReadPNG* p = reinterpret_cast<ReadPNG*>(png_get_error_ptr(png));
+    p->Error(png, error);
+}
+
 static void info_relay(png_structp png, png_infop info) {
     ReadPNG* p = reinterpret_cast<ReadPNG*>(png_get_progressive_ptr(png));
     p->info_callback(png, info);
@@ -295,194 +766,967 @@ static void end_relay(png_structp png, png_infop info) {
 }
 
 static const char* readPNG(
-    const io::ReadImageIn::filenameType& filename, Image& image)
+    ImageFile& file, const Selection& selection, Raster& image)
 {
-    ReadPNG reader(filename, image);
+    ReadPNG reader(file, selection, image);
     int status = reader.Read();
     if (status > 0)
         return "Failed to read whole file.";
     switch (status) {
     case 0: return nullptr;
-    case -1: return "Failed to open file.";
-    case -2: return "Failed to get file size.";
-    case -3: return png_error_message.c_str();
+    case -3: return file.error.c_str();
     case -4: return "Unrecognized color type.";
+    case -5: return "Selected component not in image.";
+    case -6: return "Page not in image.";
+    case -7: return "Failed to create PNG structs.";
     }
     return "Unspecified error.";
 }
 #endif
 
-// PPM, NetPBM color image binary format.
+// NetPBM formats: PBM (P1, P4), PGM (P2, P5), PPM (P3, P6) and PAM (P7).
+// PBM bits are read as intensity, 0 for black and 1 for white.
+
+static bool is_netpbm(const std::vector<std::byte>& Head) {
+    if (Head.size() < 3 || Head[0] != static_cast<std::byte>('P'))
+        return false;
+    if (Head[1] < static_cast<std::byte>('1') ||
+        static_cast<std::byte>('7') < Head[1])
+            return false;
+    return isspace(static_cast<int>(Head[2]));
+}
+
+// Skips whitespace and comments that run from # to end of line.
+static const char* skip_netpbm_space(const char* Curr, const char* Last) {
+    while (Curr <= Last) {
+        if (*Curr == '#')
+            while (Curr <= Last && *Curr != '\n')
+                ++Curr;
+        else if (isspace(static_cast<unsigned char>(*Curr)))
+            ++Curr;
+        else
+            return Curr;
+    }
+    return nullptr;
+}
 
-static int read_ppm(const io::ReadImageIn::filenameType& filename, Image& image)
+// Parses header integer that has to be followed by whitespace.
+static const char* netpbm_int(const char* Curr, const char* Last,
+    io::ParseInt32::Type& Value)
 {
-    std::vector<std::byte> contents;
-    int status = read_whole_file(contents, filename.c_str());
-    if (status != 0)
-        return status;
-    // Read P6 width height maximum
-    if (contents.size() < 12)
-        return -3;
-    if (contents[0] != static_cast<std::byte>('P'))
-        return -3;
-    bool binary = contents[1] == static_cast<std::byte>('6');
-    if (!binary && contents[1] != static_cast<std::byte>('3'))
+    Curr = skip_netpbm_space(Curr, Last);
+    if (Curr == nullptr)
+        return nullptr;
+    io::ParserPool pp;
+    io::ParseInt32 p;
+    Curr = p.Parse(Curr, Last, pp);
+    if (Curr == nullptr || Last < Curr || !p.isWhitespace(*Curr))
+        return nullptr;
+    Value = std::get<io::ParserPool::Int32>(pp.Value);
+    return Curr;
+}
+
+// Parses PAM header lines up to and including ENDHDR.
+static const char* pam_header(const char* Curr, const char* Last,
+    io::ParseInt32::Type& Width, io::ParseInt32::Type& Height,
+    io::ParseInt32::Type& Depth, io::ParseInt32::Type& Maxval)
+{
+    while ((Curr = skip_netpbm_space(Curr, Last)) != nullptr) {
+        const char* end = Curr;
+        while (end <= Last && isalpha(static_cast<unsigned char>(*end)))
+            ++end;
+        std::string key(Curr, end);
+        if (key == "ENDHDR") {
+            while (end <= Last && *end != '\n')
+                ++end;
+            return (end <= Last) ? end : nullptr;
+        }
+        if (key == "WIDTH")
+            Curr = netpbm_int(end, Last, Width);
+        else if (key == "HEIGHT")
+            Curr = netpbm_int(end, Last, Height);
+        else if (key == "DEPTH")
+            Curr = netpbm_int(end, Last, Depth);
+        else if (key == "MAXVAL")
+            Curr = netpbm_int(end, Last, Maxval);
+        else if (key == "TUPLTYPE") {
+            // Component count is all that is needed.
+            while (end <= Last && *end != '\n')
+                ++end;
+            Curr = end;
+        } else
+            return nullptr;
+        if (Curr == nullptr)
+            return nullptr;
+    }
+    return nullptr;
+}
+
+static int read_netpbm(ImageFile& file, const Selection& selection,
+    Raster& image)
+{
+    if (selection.page != 0)
+        return -9;
+    if (!file.ReadAll())
+        return 1;
+    std::vector<std::byte>& contents(file.contents);
+    if (contents.size() < 3 || !is_netpbm(contents))
         return -3;
+    const char kind = static_cast<char>(contents[1]);
+    const bool binary = '4' <= kind;
+    const bool bits = kind == '1' || kind == '4';
     if (!binary)
         contents.push_back(std::byte(0));
-    io::ParseInt32::Type width, height, maxval;
+    io::ParseInt32::Type width = 0, height = 0, maxval = 1, components = 1;
     const char* last = reinterpret_cast<const char*>(&contents.back());
     const char* curr = reinterpret_cast<const char*>(&contents.front() + 2);
-    size_t idx = 0;
-    // Comment lines are not supported in the file.
-    io::ParserPool pp;
-    io::ParseInt32 p;
-    try {
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        width = std::get<io::ParserPool::Int32>(pp.Value);
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        height = std::get<io::ParserPool::Int32>(pp.Value);
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        maxval = std::get<io::ParserPool::Int32>(pp.Value);
-        if (width <= 0 || height <= 0 || maxval <= 0 || 65535 < maxval)
+    if (kind == '7')
+        curr = pam_header(curr, last, width, height, components, maxval);
+    else {
+        if (kind == '3' || kind == '6')
+            components = 3;
+        curr = netpbm_int(curr, last, width);
+        if (curr)
+            curr = netpbm_int(curr, last, height);
+        if (curr && !bits)
+            curr = netpbm_int(curr, last, maxval);
+    }
+    if (curr == nullptr || width <= 0 || height <= 0 || components <= 0 ||
+        maxval <= 0 || 65535 < maxval)
             return -4;
-        if (binary) {
-            curr++; // Skip whitespace.
-            idx = reinterpret_cast<const std::byte*>(curr) - &contents.front();
-            if (static_cast<int>(contents.size() - idx) != width * height * ((maxval < 256) ? 3 : 6))
-                return -5;
-        }
+    const size_t ch = components;
+    const size_t bytes = (maxval < 256) ? 1 : 2;
+    const size_t row_size = bits ? (width + 7) / 8 : width * ch * bytes;
+    size_t idx = 0;
+    if (binary) {
+        curr++; // Skip whitespace.
+        idx = reinterpret_cast<const std::byte*>(curr) - &contents.front();
+        if (contents.size() - idx != height * row_size)
+            return -5;
     }
-    catch (const io::Exception& e) {
-        return -4;
+    std::vector<size_t> index;
+    if (!selection.Map(index, ch))
+        return -8;
+    image.Resize(height, width, index.size());
+    if (binary) {
+        const std::byte* src = &contents[idx];
+        for (int row = 0; row < height; ++row, src += row_size)
+            if (bits)
+                image.SetRow(row, [&](size_t x, size_t c) {
+                    return float(((static_cast<unsigned>(src[x >> 3]) >>
+                        (7 - (x & 7))) & 1) ^ 1); });
+            else if (bytes == 1)
+                image.SetRow(row, [&](size_t x, size_t c) {
+                    return float(src[ch * x + index[c]]); });
+            else
+                image.SetRow(row, [&](size_t x, size_t c) {
+                    const std::byte* v = src + 2 * (ch * x + index[c]);
+                    return float(v[0]) * 256 + float(v[1]); });
+        return 0;
     }
-    image.resize(height);
-    for (auto& line : image) {
-        line.resize(width);
-        for (auto& pixel : line) {
-            pixel.resize(3);
-            for (auto& component : pixel)
-                if (binary) {
-                    if (maxval < 256) {
-                        component = float(contents[idx]);
-                        ++idx;
-                    } else {
-                        component = float(contents[idx]) * 256 + float(contents[idx + 1]);
-                        idx += 2;
-                    }
-                } else {
-                    curr = p.skipWhitespace(curr, last);
-                    if (curr == nullptr)
-                        return -6;
-                    curr = p.Parse(curr, last, pp);
-                    if (curr == nullptr)
-                        return -7;
-                    component = std::get<io::ParserPool::Int32>(pp.Value);
-                }
+    io::ParserPool pp;
+    io::ParseInt32 p;
+    std::vector<float> values(ch * width);
+    for (int row = 0; row < height; ++row) {
+        for (auto& component : values) {
+            curr = skip_netpbm_space(curr, last);
+            if (curr == nullptr)
+                return -6;
+            if (bits) {
+                // Digits need not be separated.
+                if (*curr != '0' && *curr != '1')
+                    return -7;
+                component = float('1' - *curr++);
+                continue;
+            }
+            try {
+                curr = p.Parse(curr, last, pp);
+            }
+            catch (const io::Exception& e) {
+                return -7;
+            }
+            if (curr == nullptr)
+                return -7;
+            component = std::get<io::ParserPool::Int32>(pp.Value);
         }
+        image.SetRow(row, [&](size_t x, size_t c) {
+            return values[ch * x + index[c]]; });
     }
     return 0;
 }
 
-static const char* readPPM(
-    const io::ReadImageIn::filenameType& filename, Image& image)
+static const char* readNetPBM(
+    ImageFile& file, const Selection& selection, Raster& image)
 {
-    int status = read_ppm(filename, image);
+    int status = read_netpbm(file, selection, image);
     if (status > 0)
         return "Failed to read whole file.";
     switch (status) {
     case 0: return nullptr;
-    case -1: return "Failed to open file.";
-    case -2: return "Failed to get file size.";
-    case -3: return "Not PPM.";
+    case -3: return "Not NetPBM.";
     case -4: return "Invalid header.";
     case -5: return "File and header size mismatch.";
     case -6: return "No whitespace when expected.";
     case -7: return "No number when expected.";
+    case -8: return "Selected component not in image.";
+    case -9: return "Page not in image.";
     }
     return "Unspecified error.";
 }
 
-static int read_image(io::ReadImageIn& Val) {
-    io::ReadImageOut out;
-    if (!Val.formatGiven()) {
-        size_t last = Val.filename().find_last_of(".");
-        if (last == std::string::npos) {
-            std::cerr << "No format nor extension in filename." << std::endl;
-            return 1;
-        }
-        Val.format() = Val.filename().substr(last + 1);
+// PFM, portable float map. Pf has one component and PF three. Negative
+// scale means little-endian samples. Rows are stored from bottom to top.
+
+static bool is_pfm(const std::vector<std::byte>& Head) {
+    if (Head.size() < 3 || Head[0] != static_cast<std::byte>('P'))
+        return false;
+    if (Head[1] != static_cast<std::byte>('F') &&
+        Head[1] != static_cast<std::byte>('f'))
+            return false;
+    return isspace(static_cast<int>(Head[2]));
+}
+
+static int read_pfm(ImageFile& file, const Selection& selection, Raster& image)
+{
+    if (selection.page != 0)
+        return -9;
+    if (!file.ReadAll())
+        return 1;
+    std::vector<std::byte>& contents(file.contents);
+    if (!is_pfm(contents))
+        return -3;
+    const size_t ch = (contents[1] == static_cast<std::byte>('F')) ? 3 : 1;
+    io::ParseInt32::Type width = 0, height = 0;
+    const char* last = reinterpret_cast<const char*>(&contents.back());
+    const char* curr = reinterpret_cast<const char*>(&contents.front() + 2);
+    curr = netpbm_int(curr, last, width);
+    if (curr)
+        curr = netpbm_int(curr, last, height);
+    if (curr)
+        curr = skip_netpbm_space(curr, last);
+    if (curr == nullptr || width <= 0 || height <= 0)
+        return -4;
+    const char* end = curr;
+    while (end <= last && !isspace(static_cast<unsigned char>(*end)))
+        ++end;
+    if (last < end)
+        return -4;
+    const std::string scale_text(curr, end);
+    char* scale_end = nullptr;
+    double scale = strtod(scale_text.c_str(), &scale_end);
+    if (scale_text.empty() || *scale_end || scale == 0.0)
+        return -4;
+    size_t idx = reinterpret_cast<const std::byte*>(end + 1) - &contents.front();
+    const size_t row_size = width * ch * sizeof(float);
+    if (contents.size() - idx != height * row_size)
+        return -5;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const bool swap = scale < 0.0;
+#else
+    const bool swap = 0.0 < scale;
+#endif
+    std::vector<size_t> index;
+    if (!selection.Map(index, ch))
+        return -8;
+    image.Resize(height, width, index.size());
+    for (int row = 0; row < height; ++row) {
+        const std::byte* src = &contents[idx + (height - 1 - row) * row_size];
+        image.SetRow(row, [&](size_t x, size_t c) {
+            const std::byte* v = src + sizeof(float) * (ch * x + index[c]);
+            std::byte b[sizeof(float)];
+            if (swap)
+                for (size_t k = 0; k < sizeof(float); ++k)
+                    b[k] = v[sizeof(float) - 1 - k];
+            else
+                memcpy(b, v, sizeof(float));
+            float f;
+            memcpy(&f, b, sizeof(float));
+            return f; });
     }
-    if (!Val.shiftGiven())
-        Val.shift() = 0.0f;
-    ReadFunc reader = nullptr;
-    float shift = 0.0f;
-    float scale = 1.0f;
-    if (Val.minimumGiven()) {
-        shift = Val.minimum();
-        if (Val.maximumGiven()) {
-            if (Val.maximum() <= Val.minimum()) {
-                std::cerr << "maximum <= minimum" << std::endl;
-                return 1;
-            }
-            scale = Val.maximum() - Val.minimum();
+    return 0;
+}
+
+static const char* readPFM(
+    ImageFile& file, const Selection& selection, Raster& image)
+{
+    int status = read_pfm(file, selection, image);
+    if (status > 0)
+        return "Failed to read whole file.";
+    switch (status) {
+    case 0: return nullptr;
+    case -3: return "Not PFM.";
+    case -4: return "Invalid header.";
+    case -5: return "File and header size mismatch.";
+    case -8: return "Selected component not in image.";
+    case -9: return "Page not in image.";
+    }
+    return "Unspecified error.";
+}
+
+// Native image container. Rows are converted from the mapped file.
+
+static bool is_native(const std::vector<std::byte>& Head) {
+    return nativeMagic(Head.data(), Head.size());
+}
+
+static int read_native(ImageFile& file, const Selection& selection,
+    Raster& image)
+{
+    if (selection.page != 0)
+        return -9;
+    int fd = file.Release();
+    NativeImage native;
+    int status = native.Map(fd);
+    close(fd);
+    if (status)
+        return status;
+    const NativeHeader& h(native.header);
+    const size_t ch = h.components;
+    std::vector<size_t> index;
+    if (!selection.Map(index, ch))
+        return -8;
+    image.Resize(h.height, h.width, index.size());
+    for (size_t row = 0; row < h.height; ++row) {
+        const unsigned char* src = native.Row(row);
+        switch (h.sample) {
+        case NativeUInt8:
+            image.SetRow(row, [&](size_t x, size_t c) {
+                return float(src[ch * x + index[c]]); });
+            break;
+        case NativeUInt16:
+            image.SetRow(row, [&](size_t x, size_t c) {
+                return float(reinterpret_cast<const std::uint16_t*>(src)[
+                    ch * x + index[c]]); });
+            break;
+        case NativeFloat32:
+            image.SetRow(row, [&](size_t x, size_t c) {
+                return reinterpret_cast<const float*>(src)[ch * x + index[c]];
+            });
+            break;
         }
-    } else if (Val.maximumGiven())
-        shift = Val.maximum();
-    if (strcasecmp(Val.format().c_str(), "ppm") == 0 ||
-        strcasecmp(Val.format().c_str(), "p6-ppm") == 0 ||
-        strcasecmp(Val.format().c_str(), "p3-ppm") == 0)
-            reader = &readPPM;
+    }
+    return 0;
+}
+
+static const char* readNative(
+    ImageFile& file, const Selection& selection, Raster& image)
+{
+    switch (read_native(file, selection, image)) {
+    case 0: return nullptr;
+    case -1: return "Not native image.";
+    case -2: return "Byte order differs from host.";
+    case -3: return "Invalid header.";
+    case -4: return "Failed to map file.";
+    case -8: return "Selected component not in image.";
+    case -9: return "Page not in image.";
+    }
+    return "Unspecified error.";
+}
+
+// Readers in the order content detection tries them. Format names are used
+// when the content is not recognized.
+
+typedef bool (*RecognizeFunc)(const std::vector<std::byte>&);
+// Stores location of each page in Offsets. Returns number of pages or
+// negative on error.
+typedef int (*PagesFunc)(ImageFile&, std::vector<uint64_t>&);
+
+struct Decoder {
+    RecognizeFunc recognize;
+    ReadFunc reader;
+    PagesFunc pages; // Null if only one page.
+    const char* formats[12];
+};
+
+static const Decoder decoders[] = {
+    { &is_native, &readNative, nullptr, { "native", "nim", nullptr } },
+    { &is_netpbm, &readNetPBM, nullptr, { "ppm", "p6-ppm", "p3-ppm",
+        "pgm", "p5-pgm", "p2-pgm", "pbm", "p4-pbm", "p1-pbm", "pam", "pnm",
+        nullptr } },
+    { &is_pfm, &readPFM, nullptr, { "pfm", nullptr } },
 #if !defined(NO_TIFF)
-    else if (strcasecmp(Val.format().c_str(), "tiff") == 0 ||
-        strcasecmp(Val.format().c_str(), "tif") == 0)
-            reader = &readTIFF;
+    { &is_tiff, &readTIFF, &pagesTIFF, { "tiff", "tif", nullptr } },
 #endif
 #if !defined(NO_PNG)
-    else if (strcasecmp(Val.format().c_str(), "png") == 0)
-        reader = &readPNG;
+    { &is_png, &readPNG, nullptr, { "png", nullptr } },
 #endif
-    else {
-        std::cerr << "Unsupported format: " << Val.format() << std::endl;
-        return 1;
+};
+
+static const Decoder* decoder_for_content(const std::vector<std::byte>& Head) {
+    for (auto& d : decoders)
+        if (d.recognize(Head))
+            return &d;
+    return nullptr;
+}
+
+static const Decoder* decoder_for_format(const std::string& Format) {
+    for (auto& d : decoders)
+        for (const char* const* f = d.formats; *f; ++f)
+            if (strcasecmp(Format.c_str(), *f) == 0)
+                return &d;
+    return nullptr;
+}
+
+// Layout is checked in read_image before any file is read.
+
+static bool planar_layout(io::ReadImageIn& Val) {
+    return Val.layoutGiven() && Val.layout() != "interleaved";
+}
+
+static bool planes_output(io::ReadImageIn& Val) {
+    return Val.layoutGiven() && Val.layout() == "planes";
+}
+
+// Opens file and finds decoder for it. Returns 1 for request errors and 2 for
+// file errors, with the reason in Error.
+
+static int open_image(ImageFile& file, io::ReadImageIn& Val,
+    const Decoder*& decoder, std::string& Error)
+{
+    switch (file.Open()) {
+    case 0: break;
+    case -1:
+        Error = "Failed to open file.";
+        return 2;
+    case -2:
+        Error = "Failed to get file size.";
+        return 2;
+    default:
+        Error = "Failed to read file.";
+        return 2;
+    }
+    // No decoder can read an empty file, whatever its name says.
+    if (file.contents.empty()) {
+        Error = "Empty file.";
+        return 2;
+    }
+    decoder = decoder_for_content(file.contents);
+    if (!decoder) {
+        std::string format;
+        if (Val.formatGiven())
+            format = Val.format();
+        else {
+            size_t last = file.filename.find_last_of(".");
+            if (last == std::string::npos) {
+                Error = "Unrecognized content and no format nor extension "
+                    "in filename.";
+                return 1;
+            }
+            format = file.filename.substr(last + 1);
+        }
+        decoder = decoder_for_format(format);
+        if (!decoder) {
+            Error = "Unsupported format: " + format;
+            return 1;
+        }
     }
-    const char* err = reader(Val.filename(), out.image);
+    return 0;
+}
+
+// Reads one image or page. Does not modify Val so that several threads can
+// share it.
+
+static int decode_file(ImageFile& file, const Decoder* decoder,
+    io::ReadImageIn& Val, size_t Page, uint64_t Offset, Image& image,
+    const SizeHook* Hook, std::string& Error)
+{
+    Selection selection;
+    selection.page = Page;
+    selection.offset = Offset;
+    if (Val.channelsGiven())
+        for (auto c : Val.channels()) {
+            if (c < 0) {
+                Error = "Negative component index.";
+                return 1;
+            }
+            selection.channels.push_back(c);
+        }
+    Raster raster(image, planar_layout(Val), Hook);
+    const char* err = decoder->reader(file, selection, raster);
     if (err) {
-        std::cerr << err << std::endl;
+        Error = err;
         return 2;
     }
-    // Data is positive integers at this point.
+    return 0;
+}
+
+// Opens Filename and reads one image or page from it.
+
+static int decode_image(const std::string& Filename, io::ReadImageIn& Val,
+    size_t Page, uint64_t Offset, Image& image, const SizeHook* Hook,
+    std::string& Error)
+{
+    ImageFile file(Filename);
+    const Decoder* decoder = nullptr;
+    int status = open_image(file, Val, decoder, Error);
+    if (status)
+        return status;
+    return decode_file(file, decoder, Val, Page, Offset, image, Hook, Error);
+}
+
+// Offsets has one value per page, 0 when the page can not be located directly.
+
+static int page_offsets(const std::string& Filename, io::ReadImageIn& Val,
+    std::vector<uint64_t>& Offsets, std::string& Error)
+{
+    ImageFile file(Filename);
+    const Decoder* decoder = nullptr;
+    int status = open_image(file, Val, decoder, Error);
+    if (status)
+        return status;
+    if (!decoder->pages) {
+        Offsets.assign(1, 0);
+        return 0;
+    }
+    if (decoder->pages(file, Offsets) < 0) {
+        Error = "Failed to count pages.";
+        return 2;
+    }
+    return 0;
+}
+
+// Pages of a stack are scaled using the range of values in all pages.
+
+static void scale_image(Image* Images, size_t Count, io::ReadImageIn& Val) {
+    float shift = 0.0f;
+    float scale = 1.0f;
+    if (Val.minimumGiven()) {
+        shift = Val.minimum();
+        if (Val.maximumGiven())
+            scale = Val.maximum() - Val.minimum();
+    } else if (Val.maximumGiven())
+        shift = Val.maximum();
+    else
+        return; // Values are output as they are.
+    // Data is positive integers at this point, or any floats from PFM.
     float minval, maxval;
-    minval = maxval = out.image[0][0][0];
-    for (auto& line : out.image)
-        for (auto& pixel : line)
-            for (auto& component : pixel) {
-                if (component < minval)
-                    minval = component;
-                if (maxval < component)
-                    maxval = component;
-            }
+    minval = maxval = Images[0][0][0][0];
+    for (size_t k = 0; k < Count; ++k)
+        for (auto& line : Images[k])
+            for (auto& pixel : line)
+                for (auto& component : pixel) {
+                    if (component < minval)
+                        minval = component;
+                    if (maxval < component)
+                        maxval = component;
+                }
     maxval += 1;
     if (Val.minimumGiven() || Val.maximumGiven())
         shift += Val.shift() + minval;
     if (Val.minimumGiven() && Val.maximumGiven())
         scale /= (maxval - minval);
-    for (auto& line : out.image)
+    for (size_t k = 0; k < Count; ++k)
+        for (auto& line : Images[k])
+            for (auto& pixel : line)
+                for (auto& component : pixel)
+                    component = (component + shift) * scale;
+}
+
+// Cache entries hold values as read, or scaled values if requested, in which
+// case the scaling parameters are part of the key. Selected components and
+// layout are always part of the key.
+
+static std::string scaling_key(io::ReadImageIn& Val) {
+    char key[128];
+    snprintf(key, sizeof(key), "%a %a %a",
+        Val.minimumGiven() ? Val.minimum() : NAN,
+        Val.maximumGiven() ? Val.maximum() : NAN, Val.shift());
+    return key;
+}
+
+static std::string channels_key(io::ReadImageIn& Val) {
+    std::string key("channels");
+    if (Val.channelsGiven())
+        for (auto c : Val.channels())
+            key += " " + std::to_string(c);
+    return key + (planar_layout(Val) ? " planar\n" : "\n");
+}
+
+// Reads and scales one image, using the cache if given.
+
+static int load_image(const std::string& Filename, io::ReadImageIn& Val,
+    Image& image, const SizeHook* Hook, std::string& Error)
+{
+    if (!Val.cacheGiven()) {
+        int status = decode_image(Filename, Val, 0, 0, image, Hook, Error);
+        if (status == 0)
+            scale_image(&image, 1, Val);
+        return status;
+    }
+    // The key comes from the file that is decoded on a miss.
+    ImageFile file(Filename);
+    const Decoder* decoder = nullptr;
+    int status = open_image(file, Val, decoder, Error);
+    if (status)
+        return status;
+    bool scaled = Val.cache_scaledGiven() && Val.cache_scaled() != 0 &&
+        (Val.minimumGiven() || Val.maximumGiven());
+    std::string key = cacheKey(file.Descriptor(), Filename,
+        channels_key(Val) + (scaled ? scaling_key(Val) : std::string()));
+    size_t limit = 1024;
+    if (Val.cache_sizeGiven())
+        limit = (0 < Val.cache_size()) ? Val.cache_size() : 0;
+    limit <<= 20;
+    bool cached = !key.empty() && cacheLoad(Val.cache(), key, image);
+    if (cached && scaled)
+        return 0;
+    if (!cached) {
+        status = decode_file(file, decoder, Val, 0, 0, image, Hook, Error);
+        if (status)
+            return status;
+        if (!key.empty() && !scaled)
+            cacheStore(Val.cache(), key, image, limit);
+    }
+    scale_image(&image, 1, Val);
+    if (!key.empty() && scaled && !cached)
+        cacheStore(Val.cache(), key, image, limit);
+    return 0;
+}
+
+// Reads selected or all pages in parallel, each using its own file handle.
+// Page locations are found once so that each page is found without walking
+// through the earlier pages.
+
+static int load_stack(const std::string& Filename, io::ReadImageIn& Val,
+    std::vector<Image>& Stack, const SizeHook* Hook, std::string& Error)
+{
+    std::vector<uint64_t> offsets;
+    int result = page_offsets(Filename, Val, offsets, Error);
+    if (result)
+        return result;
+    std::vector<size_t> pages;
+    if (Val.pages().empty())
+        for (size_t k = 0; k < offsets.size(); ++k)
+            pages.push_back(k);
+    else
+        for (auto p : Val.pages()) {
+            if (p < 0) {
+                Error = "Negative page index.";
+                return 1;
+            }
+            pages.push_back(p);
+        }
+    Stack.resize(pages.size());
+    std::vector<int> status(pages.size(), 0);
+    std::vector<std::string> errors(pages.size());
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t k = next++; k < pages.size(); k = next++)
+            status[k] = decode_image(Filename, Val, pages[k],
+                pages[k] < offsets.size() ? offsets[pages[k]] : 0,
+                Stack[k], Hook, errors[k]);
+    };
+    size_t workers = std::thread::hardware_concurrency();
+    if (pages.size() < workers)
+        workers = pages.size();
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w)
+        pool.push_back(std::thread(work));
+    work();
+    for (auto& thread : pool)
+        thread.join();
+    for (size_t k = 0; k < pages.size(); ++k)
+        if (status[k]) {
+            Error = "Page " + std::to_string(pages[k]) + ": " + errors[k];
+            return status[k];
+        }
+    if (!Stack.empty())
+        scale_image(&Stack.front(), Stack.size(), Val);
+    return 0;
+}
+
+static size_t image_bytes(const Image& image) {
+    size_t bytes = image.size() * sizeof(Image::value_type);
+    for (auto& line : image)
         for (auto& pixel : line)
-            for (auto& component : pixel)
-                component = (component + shift) * scale;
+            bytes += sizeof(pixel) + pixel.size() * sizeof(float);
+    return bytes;
+}
+
+static void write_json_string(std::ostream& Out, const std::string& Value) {
+    Out << '"';
+    for (char c : Value)
+        switch (c) {
+        case '"': Out << "\\\""; break;
+        case '\\': Out << "\\\\"; break;
+        case '\n': Out << "\\n"; break;
+        case '\t': Out << "\\t"; break;
+        case '\r': Out << "\\r"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "\\u%04x", static_cast<int>(c));
+                Out << hex;
+            } else
+                Out << c;
+        }
+    Out << '"';
+}
+
+// Outputs image, or each component as separate plane0, plane1, ... arrays.
+
+static void write_planes(std::ostream& Out, const Image& Planes,
+    std::vector<char>& Buffer)
+{
+    Out << '{';
+    for (size_t k = 0; k < Planes.size(); ++k) {
+        if (k)
+            Out << ',';
+        Out << "\"plane" << k << "\":";
+        io::Write(Out, Planes[k], Buffer);
+    }
+    Out << '}';
+}
+
+static void write_output(std::ostream& Out, io::ReadImageOut& Result,
+    bool Planes, std::vector<char>& Buffer)
+{
+    if (Planes)
+        write_planes(Out, Result.image, Buffer);
+    else
+        Write(Out, Result, Buffer);
+}
+
+static void write_stack(std::ostream& Out, const std::vector<Image>& Stack,
+    bool Planes, std::vector<char>& Buffer)
+{
+    Out << "{\"stack\":[";
+    for (size_t k = 0; k < Stack.size(); ++k) {
+        if (k)
+            Out << ',';
+        if (Planes)
+            write_planes(Out, Stack[k], Buffer);
+        else
+            io::Write(Out, Stack[k], Buffer);
+    }
+    Out << "]}";
+}
+
+// Reads an image or a stack of pages and writes it to Out.
+
+static int read_one(const std::string& Filename, io::ReadImageIn& Val,
+    std::ostream& Out, const SizeHook* Hook, std::string& Error)
+{
     std::vector<char> buffer;
-    Write(std::cout, out, buffer);
-    return 0;
+    if (Val.pagesGiven()) {
+        std::vector<Image> stack;
+        int status = load_stack(Filename, Val, stack, Hook, Error);
+        if (status == 0)
+            write_stack(Out, stack, planes_output(Val), buffer);
+        return status;
+    }
+    io::ReadImageOut out;
+    int status = load_image(Filename, Val, out.image, Hook, Error);
+    if (status == 0)
+        write_output(Out, out, planes_output(Val), buffer);
+    return status;
+}
+
+// Reads several files on a pool of threads. Output of each file is serialized
+// by the thread that read it. Results are written in input order as soon as
+// all earlier results have been written. Threads do not start a new file while
+// the data held exceeds the memory budget, except when nothing is held, so the
+// next file to write can always proceed. File size is the guess for a file
+// until its decoded size is known.
+
+class BatchReader {
+private:
+    io::ReadImageIn& val;
+    const std::vector<std::string>& names;
+    std::vector<std::string> results;
+    std::vector<std::string> errors;
+    std::vector<int> status;
+    std::vector<bool> done;
+    std::vector<size_t> held_by;
+    size_t next_start, held, budget;
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // Image as nested vectors and its JSON text, about 12 characters a value.
+    static size_t decoded_bytes(
+        size_t Height, size_t Width, size_t Components)
+    {
+        return Height * Width * (sizeof(std::vector<float>) +
+            Components * (sizeof(float) + 12));
+    }
+
+    bool may_start() const {
+        if (stop || next_start == names.size() || held == 0)
+            return true;
+        return held + held_by[next_start] <= budget;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this]() { return may_start(); });
+            if (stop || next_start == names.size())
+                return;
+            size_t index = next_start++;
+            held += held_by[index];
+            lock.unlock();
+            size_t decoded = 0; // Pages of a stack are added.
+            SizeHook hook = [this, index, &decoded](
+                size_t Height, size_t Width, size_t Components)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                decoded += decoded_bytes(Height, Width, Components);
+                held -= held_by[index];
+                held_by[index] = decoded;
+                held += decoded;
+                changed.notify_all();
+            };
+            std::string error, json;
+            int rv;
+            {
+                std::ostringstream text;
+                rv = read_one(names[index], val, text, &hook, error);
+                if (rv == 0)
+                    json = text.str();
+            }
+            lock.lock();
+            held -= held_by[index];
+            held_by[index] = json.size();
+            held += held_by[index];
+            results[index].swap(json);
+            errors[index].swap(error);
+            status[index] = rv;
+            done[index] = true;
+            changed.notify_all();
+        }
+    }
+
+public:
+    BatchReader(io::ReadImageIn& Val, const std::vector<std::string>& Names,
+        size_t Budget)
+        : val(Val), names(Names), results(Names.size()),
+        errors(Names.size()), status(Names.size(), 0),
+        done(Names.size(), false), held_by(Names.size(), 0),
+        next_start(0), held(0), budget(Budget), stop(false)
+    {
+        // Replaced by decoded size once the reader knows the dimensions.
+        for (size_t k = 0; k < names.size(); ++k) {
+            struct stat info;
+            if (stat(names[k].c_str(), &info) == 0)
+                held_by[k] = info.st_size;
+        }
+    }
+
+    int Read(size_t Threads, bool Array) {
+        std::vector<std::thread> pool;
+        for (size_t k = 0; k < Threads && k < names.size(); ++k)
+            pool.push_back(std::thread(&BatchReader::worker, this));
+        int rv = 0;
+        std::cout << (Array ? '[' : '{');
+        for (size_t k = 0; k < names.size(); ++k) {
+            std::string json;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this, k]() { return bool(done[k]); });
+                if (status[k] != 0) {
+                    std::cerr << names[k] << ": " << errors[k] << std::endl;
+                    rv = status[k];
+                    stop = true;
+                    changed.notify_all();
+                    break;
+                }
+                json.swap(results[k]);
+                held -= held_by[k];
+                held_by[k] = 0;
+                changed.notify_all();
+            }
+            if (k)
+                std::cout << ',';
+            if (!Array) {
+                write_json_string(std::cout, names[k]);
+                std::cout << ':';
+            }
+            std::cout << json;
+        }
+        // Output of a failed batch is left incomplete so it does not parse.
+        if (rv == 0)
+            std::cout << (Array ? ']' : '}');
+        std::cout.flush();
+        for (auto& t : pool)
+            t.join();
+        return rv;
+    }
+};
+
+static int read_batch(io::ReadImageIn& Val) {
+    std::vector<std::string> names;
+    if (Val.filenameGiven())
+        names.push_back(Val.filename());
+    if (Val.filenamesGiven())
+        names.insert(names.end(), Val.filenames().begin(), Val.filenames().end());
+    if (Val.globGiven()) {
+        glob_t matches;
+        int status = glob(Val.glob().c_str(), 0, nullptr, &matches);
+        if (status != 0 && status != GLOB_NOMATCH) {
+            std::cerr << "Failed to expand: " << Val.glob() << std::endl;
+            return 1;
+        }
+        for (size_t k = 0; k < matches.gl_pathc; ++k)
+            names.push_back(matches.gl_pathv[k]);
+        globfree(&matches);
+    }
+    bool array = false;
+    if (Val.batchGiven()) {
+        if (Val.batch() == "array")
+            array = true;
+        else if (Val.batch() != "object") {
+            std::cerr << "Unsupported batch: " << Val.batch() << std::endl;
+            return 1;
+        }
+    }
+    if (!array) {
+        std::vector<std::string> sorted(names);
+        std::sort(sorted.begin(), sorted.end());
+        auto dup = std::adjacent_find(sorted.begin(), sorted.end());
+        if (dup != sorted.end()) {
+            std::cerr << "Duplicate file name as key: " << *dup << std::endl;
+            return 1;
+        }
+    }
+    size_t threads = std::thread::hardware_concurrency();
+    if (Val.threadsGiven())
+        threads = (0 < Val.threads()) ? Val.threads() : 1;
+    if (threads == 0)
+        threads = 1;
+    size_t budget = 1024;
+    if (Val.memoryGiven())
+        budget = (0 < Val.memory()) ? Val.memory() : 1;
+    BatchReader reader(Val, names, budget << 20);
+    return reader.Read(threads, array);
+}
+
+static int read_image(io::ReadImageIn& Val) {
+    if (!Val.shiftGiven())
+        Val.shift() = 0.0f;
+    if (Val.minimumGiven() && Val.maximumGiven() &&
+        Val.maximum() <= Val.minimum())
+    {
+        std::cerr << "maximum <= minimum" << std::endl;
+        return 1;
+    }
+    if (Val.layoutGiven() && Val.layout() != "interleaved" &&
+        Val.layout() != "planar" && Val.layout() != "planes")
+    {
+        std::cerr << "Unsupported layout: " << Val.layout() << std::endl;
+        return 1;
+    }
+    if (Val.filenamesGiven() || Val.globGiven())
+        return read_batch(Val);
+    if (!Val.filenameGiven()) {
+        std::cerr << "No filename, filenames nor glob given." << std::endl;
+        return 1;
+    }
+    std::string error;
+    int status = read_one(Val.filename(), Val, std::cout, nullptr, error);
+    if (status)
+        std::cerr << error << std::endl;
+    return status;
 }
 
 int main(int argc, char** argv) {
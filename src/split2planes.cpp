@@ -12,6 +12,7 @@
 #include <doctest/doctest.h>
 #else
 #include "convenience.hpp"
+#include "atomicfile.hpp"
 #endif
 #include <iostream>
 #include <fcntl.h>
@@ -23,6 +24,10 @@
 #include <cstdint>
 #include <sstream>
 #include <deque>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <atomic>
 
 static size_t plane_count(io::Split2PlanesIn::planesType& Planes) {
     size_t count = 0;
@@ -36,21 +41,97 @@ static size_t plane_count(io::Split2PlanesIn::planesType& Planes) {
     return count;
 }
 
-static void separate(std::vector<std::vector<float>>& Out,
-    io::Split2PlanesIn::planesType& Planes, size_t Index)
+// Stores components of each pixel in Src to rows Dest[0] ... Dest[N - 1].
+template<size_t N>
+static void separate_row(float* const* Dest,
+    const std::vector<std::vector<float>>& Src)
 {
-    Out.resize(Planes.size());
+    for (size_t k = 0; k < Src.size(); ++k) {
+        const float* pixel = Src[k].data();
+        for (size_t c = 0; c < N; ++c)
+            Dest[c][k] = pixel[c];
+    }
+}
+
+static void separate_row(float* const* Dest,
+    const std::vector<std::vector<float>>& Src, size_t Count)
+{
+    for (size_t k = 0; k < Src.size(); ++k) {
+        const float* pixel = Src[k].data();
+        for (size_t c = 0; c < Count; ++c)
+            Dest[c][k] = pixel[c];
+    }
+}
+
+// Extracts all Count planes in one pass so that each pixel is read once.
+// Out[c] is plane c. Release frees each input row once it has been used.
+static void separate_all(std::vector<std::vector<std::vector<float>>>& Out,
+    io::Split2PlanesIn::planesType& Planes, size_t Count, bool Release)
+{
+    Out.resize(Count);
+    for (auto& plane : Out)
+        plane.resize(Planes.size());
+    std::vector<float*> dest(Count);
     for (size_t row_index = 0; row_index < Planes.size(); ++row_index) {
-        std::vector<float>& row = Out[row_index];
-        std::vector<std::vector<float>>& src = Planes[row_index];
-        row.resize(src.size());
-        for (size_t k = 0; k < src.size(); ++k)
-            row[k] = src[k][Index];
+        const std::vector<std::vector<float>>& src = Planes[row_index];
+        for (size_t c = 0; c < Count; ++c) {
+            Out[c][row_index].resize(src.size());
+            dest[c] = Out[c][row_index].data();
+        }
+        switch (Count) {
+        case 1: separate_row<1>(dest.data(), src); break;
+        case 2: separate_row<2>(dest.data(), src); break;
+        case 3: separate_row<3>(dest.data(), src); break;
+        case 4: separate_row<4>(dest.data(), src); break;
+        default: separate_row(dest.data(), src, Count); break;
+        }
+        if (Release)
+            std::vector<std::vector<float>>().swap(Planes[row_index]);
     }
 }
 
 #if !defined(UNITTEST)
 
+// Calls Func(k) for k in [0, Count) using a thread per core.
+template<typename Function>
+static void for_each_parallel(size_t Count, Function Func) {
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t k = next++; k < Count; k = next++)
+            Func(k);
+    };
+    size_t workers = std::thread::hardware_concurrency();
+    if (Count < workers)
+        workers = Count;
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w)
+        pool.push_back(std::thread(work));
+    work();
+    for (auto& thread : pool)
+        thread.join();
+}
+
+// Writes plane to Filename and releases it. Returns error message or empty.
+static std::string write_plane(const std::string& Filename,
+    std::vector<std::vector<float>>& Plane)
+{
+    AtomicFile file(Filename);
+    if (file.Open() == -1)
+        return "Failed to open: " + Filename;
+    std::ofstream out(file.Name().c_str());
+    std::vector<char> buffer;
+    io::Write(out, Plane, buffer);
+    out << std::endl;
+    std::vector<std::vector<float>>().swap(Plane);
+    bool ok = out.good();
+    out.close();
+    if (!ok || out.fail())
+        return "Error writing to output: " + Filename;
+    if (!file.Commit(false))
+        return Filename + ": " + strerror(errno);
+    return std::string();
+}
+
 static int split2planes(io::Split2PlanesIn& Val) {
     size_t count = 0;
     try {
@@ -60,13 +141,36 @@ static int split2planes(io::Split2PlanesIn& Val) {
         std::cerr << msg << std::endl;
         return 1;
     }
+    if (Val.outputsGiven() && Val.outputs().size() != count) {
+        std::cerr << "Got " << Val.outputs().size() << " outputs for " <<
+            count << " planes.\n";
+        return 1;
+    }
+    std::vector<std::vector<std::vector<float>>> planes;
+    separate_all(planes, Val.planes(), count, true);
+    if (Val.outputsGiven()) {
+        std::vector<std::string> errors(count);
+        for_each_parallel(count, [&](size_t k) {
+            errors[k] = write_plane(Val.outputs()[k], planes[k]); });
+        int status = 0;
+        for (auto& error : errors)
+            if (!error.empty()) {
+                std::cerr << error << std::endl;
+                status = 2;
+            }
+        if (status)
+            return status;
+        std::cout << "{\"outputs\":";
+        std::vector<char> buffer;
+        io::Write(std::cout, Val.outputs(), buffer);
+        std::cout << '}' << std::endl;
+        return 0;
+    }
     std::cout << '{';
-    std::vector<std::vector<float>> plane;
     std::vector<char> buffer;
     for (size_t k = 0; k < count; ++k) {
-        separate(plane, Val.planes(), k);
         std::cout << "\"plane" << k << "\":";
-        io::Write(std::cout, plane, buffer);
+        io::Write(std::cout, planes[k], buffer);
         if (k + 1 < count)
             std::cout << ',';
     }
@@ -88,6 +192,20 @@ int main(int argc, char** argv) {
 
 #else
 
+// Extracts one plane with a pass over the input, for comparison.
+static void separate(std::vector<std::vector<float>>& Out,
+    io::Split2PlanesIn::planesType& Planes, size_t Index)
+{
+    Out.resize(Planes.size());
+    for (size_t row_index = 0; row_index < Planes.size(); ++row_index) {
+        std::vector<float>& row = Out[row_index];
+        std::vector<std::vector<float>>& src = Planes[row_index];
+        row.resize(src.size());
+        for (size_t k = 0; k < src.size(); ++k)
+            row[k] = src[k][Index];
+    }
+}
+
 TEST_CASE("plane_count") {
     SUBCASE("All same") {
         std::vector<std::vector<float>> row;
@@ -154,4 +272,55 @@ TEST_CASE("separate") {
     }
 }
 
+static io::Split2PlanesIn::planesType test_planes(size_t Count) {
+    io::Split2PlanesIn::planesType planes;
+    planes.push_back(std::vector<std::vector<float>>());
+    float value = 0.0f;
+    for (size_t width = 1; width < 8; width += 3) {
+        std::vector<std::vector<float>> row;
+        for (size_t k = 0; k < width; ++k) {
+            row.push_back(std::vector<float>());
+            for (size_t c = 0; c < Count; ++c)
+                row.back().push_back(value++);
+        }
+        planes.push_back(row);
+    }
+    return planes;
+}
+
+TEST_CASE("separate_all") {
+    std::vector<std::vector<std::vector<float>>> out;
+    std::vector<std::vector<float>> plane;
+    SUBCASE("Same as separate") {
+        // Fixed counts 1 to 4 and the general case.
+        for (size_t count = 1; count < 7; ++count) {
+            io::Split2PlanesIn::planesType planes = test_planes(count);
+            separate_all(out, planes, count, false);
+            REQUIRE(out.size() == count);
+            for (size_t c = 0; c < count; ++c) {
+                separate(plane, planes, c);
+                REQUIRE(out[c] == plane);
+            }
+        }
+    }
+    SUBCASE("Empty") {
+        io::Split2PlanesIn::planesType planes;
+        separate_all(out, planes, 3, false);
+        REQUIRE(out.size() == 3);
+        for (auto& p : out)
+            REQUIRE(p.empty());
+    }
+    SUBCASE("Release") {
+        io::Split2PlanesIn::planesType planes = test_planes(2);
+        io::Split2PlanesIn::planesType copy = planes;
+        separate_all(out, planes, 2, true);
+        for (size_t c = 0; c < 2; ++c) {
+            separate(plane, copy, c);
+            REQUIRE(out[c] == plane);
+        }
+        for (auto& row : planes)
+            REQUIRE(row.empty());
+    }
+}
+
 #endif
@@ -12,6 +12,7 @@
 #include <doctest/doctest.h>
 #else
 #include "convenience.hpp"
+#include "atomicfile.hpp"
 #endif
 #include <iostream>
 #include <fcntl.h>
@@ -23,6 +24,8 @@
 #include <cstdint>
 #include <sstream>
 #include <deque>
+#include <cstring>
+#include <cerrno>
 
 
 #if !defined(UNITTEST)
@@ -39,7 +42,12 @@ static int writecollada(io::WriteColladaIn& Val) {
             else
                 triangles.push_back(std::vector<std::uint32_t> {
                     strip[k], strip[k + 1], strip[k + 2] });
-    std::ofstream out(Val.filename().c_str());
+    AtomicFile file(Val.filename());
+    if (file.Open() == -1) {
+        std::cerr << "Failed to open: " << Val.filename() << std::endl;
+        return 1;
+    }
+    std::ofstream out(file.Name().c_str());
     if (out.fail()) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
         return 1;
@@ -98,7 +106,15 @@ static int writecollada(io::WriteColladaIn& Val) {
 </COLLADA>)WRDAE";
     bool ok = out.good();
     out.close();
-    return ok ? 0 : 2;
+    if (!ok || out.fail()) {
+        std::cerr << "Error writing to output: " << Val.filename() << std::endl;
+        return 2;
+    }
+    if (!file.Commit(Val.syncGiven() && Val.sync() != 0)) {
+        std::cerr << Val.filename() << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv) {
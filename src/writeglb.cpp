@@ -12,6 +12,7 @@
 #include <doctest/doctest.h>
 #else
 #include "convenience.hpp"
+#include "atomicfile.hpp"
 #endif
 #include "memimage.hpp"
 #include <iostream>
@@ -24,6 +25,8 @@
 #include <cstdint>
 #include <strstream>
 #include <deque>
+#include <cstring>
+#include <cerrno>
 
 
 template<typename T>
@@ -87,6 +90,24 @@ static size_t flatten(std::vector<float>& Out,
 static int writeglb(io::WriteGLBIn& Val) {
     if (Val.filename().substr(Val.filename().size() - 4) != ".glb")
         Val.filename() += ".glb";
+    PNGOptions options;
+    if (Val.levelGiven()) {
+        if (Val.level() < 0 || 9 < Val.level()) {
+            std::cerr << "Compression level not in 0 to 9.\n";
+            return 1;
+        }
+        options.level = Val.level();
+    }
+    if (Val.filterGiven() && !pngFilter(Val.filter(), options)) {
+        std::cerr << "Unknown filter: " << Val.filter() << std::endl;
+        return 1;
+    }
+    // Last so that store overrides level and filter.
+    if (Val.compressionGiven() && !pngCompression(Val.compression(), options))
+    {
+        std::cerr << "Unknown compression: " << Val.compression() << std::endl;
+        return 1;
+    }
     Buffer<char> header, json_chunk, bin;
     header.write_u32(0x46546C67).write_u32(2);
     json_chunk.write_u32(0).write_u32(0x4E4F534A);
@@ -143,13 +164,23 @@ static int writeglb(io::WriteGLBIn& Val) {
     size_t image_len = 0;
     int image_max = 0;
     if (Val.textureGiven()) {
-        std::vector<unsigned char> img = memoryPNG(Val.texture(), 8);
-        image_len = img.size();
-        for (auto& b : img) {
-            if (image_max < b)
-                image_max = b;
-            bin << static_cast<char>(b);
+        size_t start = bin.size();
+        PNGCallbackSink sink([&bin, &image_max](const unsigned char* Data,
+            size_t Length)
+        {
+            for (size_t k = 0; k < Length; ++k)
+                if (image_max < Data[k])
+                    image_max = Data[k];
+            bin.insert(bin.end(), reinterpret_cast<const char*>(Data),
+                reinterpret_cast<const char*>(Data) + Length);
+            return true;
+        });
+        PNGEncoder encoder;
+        if (!encoder.Encode(Val.texture(), 8, sink, options)) {
+            std::cerr << encoder.Error() << std::endl;
+            return 1;
         }
+        image_len = bin.size() - start;
         json << R"GLTF(,
 {"buffer":0,"byteOffset":)GLTF"
             << end_of_previous + coordinates_len << R"GLTF(,"byteLength":)GLTF"
@@ -197,17 +228,19 @@ static int writeglb(io::WriteGLBIn& Val) {
         bin << '\0';
     bin.write_u32(bin.size() - 8, 0);
     header.write_u32(header.size() + 4 + json_chunk.size() + bin.size());
-    std::ofstream out(Val.filename().c_str(),
-        std::ios_base::out | std::ios_base::binary);
-    if (out.fail()) {
+    AtomicFile file(Val.filename());
+    if (file.Open() == -1) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
         return 1;
     }
-    out.write(&header.front(), header.size());
-    out.write(&json_chunk.front(), json_chunk.size());
-    out.write(&bin.front(), bin.size());
-    bool ok = out.good();
-    out.close();
+    bool ok = file.Reserve(
+        header.size() + json_chunk.size() + bin.size(), true) &&
+        file.Write(&header.front(), header.size()) &&
+        file.Write(&json_chunk.front(), json_chunk.size()) &&
+        file.Write(&bin.front(), bin.size()) &&
+        file.Commit(Val.syncGiven() && Val.sync() != 0);
+    if (!ok)
+        std::cerr << Val.filename() << ": " << strerror(errno) << std::endl;
     return ok ? 0 : 2;
 }
 
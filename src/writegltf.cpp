@@ -12,6 +12,7 @@
 #include <doctest/doctest.h>
 #else
 #include "convenience.hpp"
+#include "atomicfile.hpp"
 #endif
 #include <iostream>
 #include <fcntl.h>
@@ -23,6 +24,8 @@
 #include <cstdint>
 #include <sstream>
 #include <deque>
+#include <cstring>
+#include <cerrno>
 
 
 static void base64encode(std::vector<char>& Out, const char* Src, size_t Len) {
@@ -93,7 +96,12 @@ static void accessor_object(std::ofstream& Out, size_t Count,
 static int writegltf(io::WriteglTFIn& Val) {
     if (Val.filename().substr(Val.filename().size() - 5) != ".gltf")
         Val.filename() += ".gltf";
-    std::ofstream out(Val.filename().c_str());
+    AtomicFile file(Val.filename());
+    if (file.Open() == -1) {
+        std::cerr << "Failed to open: " << Val.filename() << std::endl;
+        return 1;
+    }
+    std::ofstream out(file.Name().c_str());
     if (out.fail()) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
         return 1;
@@ -163,7 +171,15 @@ static int writegltf(io::WriteglTFIn& Val) {
 "asset":{"version":"2.0"}})GLTF";
     bool ok = out.good();
     out.close();
-    return ok ? 0 : 2;
+    if (!ok || out.fail()) {
+        std::cerr << "Error writing to output: " << Val.filename() << std::endl;
+        return 2;
+    }
+    if (!file.Commit(Val.syncGiven() && Val.sync() != 0)) {
+        std::cerr << Val.filename() << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv) {
@@ -9,6 +9,8 @@
 #include "writeimage_io.hpp"
 #include "convenience.hpp"
 #include "memimage.hpp"
+#include "nativeimage.hpp"
+#include "atomicfile.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
@@ -19,8 +21,18 @@
 #include <cstdint>
 #include <sstream>
 #include <deque>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #if !defined(NO_TIFF)
 #include <tiffio.h>
+#if !defined(NO_ZLIB)
+#include <zlib.h>
+#endif
 #endif
 #if !defined(NO_PNG)
 #include <memory>
@@ -29,18 +41,381 @@
 #endif
 
 
-typedef int (*WriteFunc)(const io::WriteImageIn::filenameType&, const io::WriteImageIn::imageType&, io::WriteImageIn::depthType);
+// Output settings resolved from the request.
+struct Output {
+    io::WriteImageIn::filenameType filename;
+    io::WriteImageIn::depthType depth;
+    bool floating; // Values are written as they are.
+    bool bigtiff; // Forced, otherwise used only when needed.
+    std::uint16_t compression; // TIFF tag value.
+    bool predictor; // Horizontal differencing.
+    std::uint32_t rows_per_strip; // Zero for default.
+    std::uint32_t tile; // Tile width and height, zero for strips.
+    int levels; // Reduced resolution levels.
+    PNGOptions png; // Level is used also for TIFF deflate.
+    bool sync; // Flush data to disk before rename.
+    size_t threads; // Share of threads when outputs are written concurrently.
+};
+
+typedef int (*WriteFunc)(const Output&, const io::WriteImageIn::imageType&);
+
+static size_t hardware_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls Func(k) for k in [0, Count) using at most Threads threads.
+template<typename Function>
+static void for_each_parallel(size_t Count, size_t Threads, Function Func) {
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t k = next++; k < Count; k = next++)
+            Func(k);
+    };
+    size_t workers = std::min(Count, Threads);
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w)
+        pool.push_back(std::thread(work));
+    work();
+    for (auto& thread : pool)
+        thread.join();
+}
 
 #if !defined(NO_TIFF)
 
-static int writeTIFF(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static std::uint16_t float_to_half(float Value) {
+    std::uint32_t bits;
+    memcpy(&bits, &Value, sizeof(bits));
+    std::uint16_t sign = (bits >> 16) & 0x8000;
+    std::int32_t exponent = std::int32_t((bits >> 23) & 0xff) - 127 + 15;
+    std::uint32_t mantissa = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) // Infinity or NaN.
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (31 <= exponent)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        std::uint32_t shift = 14 - exponent;
+        std::uint32_t half = mantissa >> shift;
+        std::uint32_t rest = mantissa & ((1u << shift) - 1);
+        std::uint32_t midpoint = 1u << (shift - 1);
+        if (midpoint < rest || (rest == midpoint && (half & 1)))
+            ++half;
+        return sign | half;
+    }
+    std::uint32_t half = (std::uint32_t(exponent) << 10) | (mantissa >> 13);
+    std::uint32_t rest = mantissa & 0x1fff;
+    if (0x1000 < rest || (rest == 0x1000 && (half & 1)))
+        ++half; // May carry into exponent, up to infinity.
+    return sign | half;
+}
+
+// Appends row in sample format of output. Integer samples up to 16 bits have
+// been quantized already. 32-bit integers are quantized here from [0, 1] to
+// keep precision.
+static void tiff_row(std::vector<unsigned char>& Row,
+    const std::vector<std::vector<float>>& Line, const Output& Out,
+    size_t Begin, size_t End)
 {
-    TIFF* t = TIFFOpen(filename.c_str(), "w");
-    if (!t) {
-        std::cerr << "Failed to open output file: " << filename << std::endl;
-        return 1;
+    Row.resize(0);
+    for (size_t x = Begin; x < End; ++x)
+        for (auto& component : Line[x]) {
+            size_t at = Row.size();
+            if (Out.depth == 8) {
+                Row.push_back(static_cast<unsigned char>(component));
+                continue;
+            }
+            Row.resize(at + Out.depth / 8);
+            if (Out.floating && Out.depth == 32)
+                memcpy(&Row[at], &component, sizeof(float));
+            else if (Out.floating) {
+                std::uint16_t h = float_to_half(component);
+                memcpy(&Row[at], &h, sizeof(h));
+            } else if (Out.depth == 32) {
+                double v = trunc(double(component) * 4294967296.0);
+                std::uint32_t u = (4294967295.0 < v) ?
+                    4294967295u : static_cast<std::uint32_t>(v);
+                memcpy(&Row[at], &u, sizeof(u));
+            } else {
+                std::uint16_t u = static_cast<std::uint16_t>(component);
+                memcpy(&Row[at], &u, sizeof(u));
+            }
+        }
+}
+
+// Compressions that are done here so that strips can be compressed in
+// parallel. Others are left to libtiff.
+static bool own_codec(std::uint16_t Compression) {
+    switch (Compression) {
+    case COMPRESSION_NONE:
+    case COMPRESSION_PACKBITS:
+    case COMPRESSION_LZW:
+#if !defined(NO_ZLIB)
+    case COMPRESSION_ADOBE_DEFLATE:
+#endif
+        return true;
+    }
+    return false;
+}
+
+// Horizontal predictor, replaces samples with difference to previous pixel.
+static void difference_row(std::vector<unsigned char>& Row, size_t Samples,
+    size_t Bytes)
+{
+    size_t stride = Samples * Bytes;
+    for (size_t at = Row.size(); stride < at; at -= Bytes) {
+        size_t k = at - Bytes;
+        if (Bytes == 1)
+            Row[k] -= Row[k - stride];
+        else if (Bytes == 2) {
+            std::uint16_t v, prev;
+            memcpy(&v, &Row[k], 2);
+            memcpy(&prev, &Row[k - stride], 2);
+            v -= prev;
+            memcpy(&Row[k], &v, 2);
+        } else {
+            std::uint32_t v, prev;
+            memcpy(&v, &Row[k], 4);
+            memcpy(&prev, &Row[k - stride], 4);
+            v -= prev;
+            memcpy(&Row[k], &v, 4);
+        }
+    }
+}
+
+// Each row is packed separately as runs do not cross rows.
+static void packbits_row(std::vector<unsigned char>& Out,
+    const std::vector<unsigned char>& Row)
+{
+    size_t k = 0;
+    while (k < Row.size()) {
+        size_t run = 1;
+        while (k + run < Row.size() && run < 128 && Row[k + run] == Row[k])
+            ++run;
+        if (1 < run) {
+            Out.push_back(static_cast<unsigned char>(257 - run));
+            Out.push_back(Row[k]);
+            k += run;
+            continue;
+        }
+        size_t start = k;
+        while (k < Row.size() && k - start < 128) {
+            if (k + 1 < Row.size() && Row[k] == Row[k + 1])
+                break;
+            ++k;
+        }
+        Out.push_back(static_cast<unsigned char>(k - start - 1));
+        Out.insert(Out.end(), Row.begin() + start, Row.begin() + k);
+    }
+}
+
+// TIFF variant of LZW with MSB-first codes and early code width change.
+class LZWEncoder {
+private:
+    enum { Clear = 256, End = 257, First = 258, Last = 4094, HashSize = 9973 };
+    std::vector<std::int32_t> keys;
+    std::vector<std::uint16_t> codes;
+    std::vector<unsigned char>& out;
+    std::uint32_t bits, bit_count;
+    unsigned int width, next;
+
+    void put(unsigned int Code) {
+        bits = (bits << width) | Code;
+        bit_count += width;
+        while (8 <= bit_count) {
+            bit_count -= 8;
+            out.push_back(static_cast<unsigned char>(bits >> bit_count));
+        }
+    }
+
+    void reset() {
+        std::fill(keys.begin(), keys.end(), -1);
+        width = 9;
+        next = First;
+    }
+
+    // Adds entry for the code just output. Clears table when full.
+    void added() {
+        if (++next == Last) {
+            put(Clear);
+            reset();
+        } else if ((1u << width) - 1 < next)
+            ++width;
+    }
+
+public:
+    LZWEncoder(std::vector<unsigned char>& Out)
+        : keys(HashSize), codes(HashSize), out(Out), bits(0), bit_count(0)
+    {
+        reset();
+        put(Clear);
+    }
+
+    void Encode(const std::vector<unsigned char>& Data) {
+        if (!Data.empty()) {
+            std::int32_t prefix = Data[0];
+            for (size_t k = 1; k < Data.size(); ++k) {
+                std::int32_t key = (prefix << 8) | Data[k];
+                size_t h = static_cast<size_t>(key) % HashSize;
+                while (keys[h] != -1 && keys[h] != key)
+                    h = (h + 1 == HashSize) ? 0 : h + 1;
+                if (keys[h] == key) {
+                    prefix = codes[h];
+                    continue;
+                }
+                put(prefix);
+                keys[h] = key;
+                codes[h] = next;
+                added();
+                prefix = Data[k];
+            }
+            put(prefix);
+            added();
+        }
+        // Empty input is Clear and End, flushed as any other.
+        put(End);
+        if (bit_count)
+            out.push_back(static_cast<unsigned char>(bits << (8 - bit_count)));
+    }
+};
+
+// Strip or tile layout of an image.
+struct Chunks {
+    bool tiled;
+    std::uint32_t width, height; // Tile size, or image width and strip rows.
+    size_t across, count;
+};
+
+// Converts rows to samples and, for compressions done here, applies predictor
+// and compresses them. Tiles at right and bottom edges are padded with zeros.
+static bool encode_chunk(std::vector<unsigned char>& Strip,
+    std::vector<unsigned char>& Row, const Output& Out,
+    const io::WriteImageIn::imageType& image, const Chunks& Layout, size_t K)
+{
+    bool own = own_codec(Out.compression);
+    std::vector<unsigned char> data;
+    size_t left = (K % Layout.across) * Layout.width;
+    size_t right = std::min(left + Layout.width, image[0].size());
+    size_t top = (K / Layout.across) * Layout.height;
+    size_t end = top + Layout.height;
+    if (!Layout.tiled)
+        end = std::min(end, image.size());
+    size_t row_bytes = Layout.width * image[0][0].size() * (Out.depth / 8);
+    for (size_t y = top; y < end; ++y) {
+        if (y < image.size())
+            tiff_row(Row, image[y], Out, left, right);
+        else
+            Row.resize(0);
+        Row.resize(row_bytes, 0);
+        if (own && Out.predictor)
+            difference_row(Row, image[0][0].size(), Out.depth / 8);
+        if (own && Out.compression == COMPRESSION_PACKBITS)
+            packbits_row(data, Row);
+        else
+            data.insert(data.end(), Row.begin(), Row.end());
+    }
+    Strip.resize(0);
+    switch (own ? Out.compression : COMPRESSION_NONE) {
+    case COMPRESSION_LZW: {
+        LZWEncoder lzw(Strip);
+        lzw.Encode(data);
+        return true;
+    }
+#if !defined(NO_ZLIB)
+    case COMPRESSION_ADOBE_DEFLATE: {
+        uLongf size = compressBound(data.size());
+        Strip.resize(size);
+        if (compress2(&Strip.front(), &size, &data.front(), data.size(),
+            (Out.png.level < 0) ? Z_DEFAULT_COMPRESSION : Out.png.level) != Z_OK)
+                return false;
+        Strip.resize(size);
+        return true;
+    }
+#endif
+    }
+    Strip.swap(data);
+    return true;
+}
+
+// Strips or tiles are encoded in parallel and written in order. Workers stay
+// within a window of chunks ahead of the writer to limit memory use.
+static bool write_chunks(TIFF* t, const Output& Out,
+    const io::WriteImageIn::imageType& image, const Chunks& Layout)
+{
+    size_t count = Layout.count;
+    size_t workers = std::min(count, Out.threads);
+    size_t window = 2 * workers;
+    std::vector<std::vector<unsigned char>> strips(count);
+    std::vector<char> done(count, 0), encoded(count, 0);
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t next = 0, written = 0;
+    bool failed = false;
+    auto work = [&]() {
+        std::vector<unsigned char> row, strip;
+        while (true) {
+            size_t k;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() {
+                    return failed || count <= next || next < written + window;
+                });
+                if (failed || count <= next)
+                    return;
+                k = next++;
+            }
+            bool ok = encode_chunk(strip, row, Out, image, Layout, k);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                strips[k].swap(strip);
+                encoded[k] = ok;
+                done[k] = 1;
+            }
+            changed.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; ++w)
+        pool.push_back(std::thread(work));
+    bool own = own_codec(Out.compression);
+    bool ok = true;
+    for (size_t k = 0; ok && k < count; ++k) {
+        std::vector<unsigned char> strip;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return done[k] != 0; });
+            strip.swap(strips[k]);
+            ok = encoded[k] != 0;
+        }
+        if (ok) {
+            tmsize_t size = static_cast<tmsize_t>(strip.size());
+            if (Layout.tiled && own)
+                ok = TIFFWriteRawTile(t, k, &strip.front(), size) == size;
+            else if (Layout.tiled)
+                ok = TIFFWriteEncodedTile(t, k, &strip.front(), size) != -1;
+            else if (own)
+                ok = TIFFWriteRawStrip(t, k, &strip.front(), size) == size;
+            else
+                ok = TIFFWriteEncodedStrip(t, k, &strip.front(), size) != -1;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            written = k + 1;
+            failed = !ok;
+        }
+        changed.notify_all();
     }
+    for (auto& thread : pool)
+        thread.join();
+    return ok;
+}
+
+// Sets fields of current directory and writes the image.
+static bool write_tiff_page(TIFF* t, const Output& Out,
+    const io::WriteImageIn::imageType& image)
+{
+    const io::WriteImageIn::depthType depth(Out.depth);
     TIFFSetField(t, TIFFTAG_IMAGEWIDTH,
         static_cast<std::uint32_t>(image[0].size()));
     TIFFSetField(t, TIFFTAG_IMAGELENGTH,
@@ -48,10 +423,16 @@ static int writeTIFF(const io::WriteImageIn::filenameType& filename,
     TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL,
         static_cast<std::uint16_t>(image[0][0].size()));
     TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, static_cast<std::uint16_t>(depth));
-    TIFFSetField(t, TIFFTAG_MAXSAMPLEVALUE,
-        static_cast<std::uint16_t>((1 << depth) - 1));
-    TIFFSetField(t, TIFFTAG_MINSAMPLEVALUE, 0);
-    TIFFSetField(t, TIFFTAG_COMPRESSION, static_cast<std::uint16_t>(1));
+    if (Out.floating)
+        TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    else if (depth <= 16) {
+        TIFFSetField(t, TIFFTAG_MAXSAMPLEVALUE,
+            static_cast<std::uint16_t>((1 << depth) - 1));
+        TIFFSetField(t, TIFFTAG_MINSAMPLEVALUE, 0);
+    }
+    TIFFSetField(t, TIFFTAG_COMPRESSION, Out.compression);
+    if (Out.predictor)
+        TIFFSetField(t, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
     TIFFSetField(t, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(t, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
     if (image[0][0].size() < 3) {
@@ -73,287 +454,1025 @@ static int writeTIFF(const io::WriteImageIn::filenameType& filename,
                 static_cast<std::uint16_t>(other.size()), &other.front());
         }
     }
-    uint32 count = 0;
-    std::vector<unsigned char> buf;
-    buf.reserve(image[0].size() * image[0][0].size() * ((8 < depth) ? 2 : 1));
-    for (auto& line : image) {
-        buf.resize(0);
-        for (auto& pixel : line)
-            if (depth == 8)
-                for (auto& component : pixel)
-                    buf.push_back(static_cast<unsigned char>(component));
+    Chunks layout;
+    layout.tiled = Out.tile != 0;
+    if (layout.tiled) {
+        layout.width = layout.height = Out.tile;
+        TIFFSetField(t, TIFFTAG_TILEWIDTH, layout.width);
+        TIFFSetField(t, TIFFTAG_TILELENGTH, layout.height);
+        layout.across = (image[0].size() + Out.tile - 1) / Out.tile;
+    } else {
+        std::uint32_t rows = Out.rows_per_strip;
+        if (rows == 0) {
+            // Larger strips compress better and amortize per-strip setup.
+            size_t row_bytes =
+                image[0].size() * image[0][0].size() * (depth / 8);
+            if (Out.compression == COMPRESSION_NONE)
+                rows = TIFFDefaultStripSize(t, 0);
             else
-                for (auto& component : pixel) {
-                    buf.push_back(0);
-                    buf.push_back(0);
-                    *reinterpret_cast<std::uint16_t*>((&buf.back()) - 1) =
-                        static_cast<std::uint16_t>(component);
-                }
-        if (TIFFWriteScanline(t, static_cast<tdata_t>(&buf.front()), count++, 0) != 1)
+                rows = std::max(size_t(1), size_t(262144) / row_bytes);
+        }
+        rows = std::min(rows, static_cast<std::uint32_t>(image.size()));
+        TIFFSetField(t, TIFFTAG_ROWSPERSTRIP, rows);
+        layout.width = image[0].size();
+        layout.height = rows;
+        layout.across = 1;
+    }
+    layout.count = layout.across *
+        ((image.size() + layout.height - 1) / layout.height);
+    return write_chunks(t, Out, image, layout);
+}
+
+// Halves width and height by averaging 2 by 2 blocks. Integer samples up to
+// 16 bits have been quantized already so averages are rounded.
+static void downsample(const io::WriteImageIn::imageType& Source,
+    io::WriteImageIn::imageType& Reduced, const Output& Out)
+{
+    size_t width = Source[0].size();
+    size_t components = Source[0][0].size();
+    bool round = !Out.floating && Out.depth <= 16;
+    Reduced.resize((Source.size() + 1) / 2);
+    for_each_parallel(Reduced.size(), Out.threads, [&](size_t y) {
+        Reduced[y].assign((width + 1) / 2, std::vector<float>(components));
+        size_t bottom = std::min(2 * y + 1, Source.size() - 1);
+        for (size_t x = 0; x < Reduced[y].size(); ++x) {
+            size_t right = std::min(2 * x + 1, width - 1);
+            float count = (bottom - 2 * y + 1) * (right - 2 * x + 1);
+            for (size_t c = 0; c < components; ++c) {
+                float sum = 0.0f;
+                for (size_t sy = 2 * y; sy <= bottom; ++sy)
+                    for (size_t sx = 2 * x; sx <= right; ++sx)
+                        sum += Source[sy][sx][c];
+                sum /= count;
+                Reduced[y][x][c] = round ? floor(sum + 0.5f) : sum;
+            }
+        }
+    });
+}
+
+// Number of reduced levels until image is a single pixel, at most Levels.
+static int level_count(const io::WriteImageIn::imageType& image, int Levels) {
+    size_t width = image[0].size(), height = image.size();
+    int count = 0;
+    while (count < Levels && (1 < width || 1 < height)) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        ++count;
+    }
+    return count;
+}
+
+// Writes image and its reduced resolution levels as SubIFDs.
+static bool write_tiff_levels(TIFF* t, const Output& Out,
+    const io::WriteImageIn::imageType& image)
+{
+    int levels = level_count(image, Out.levels);
+    if (levels) {
+        std::vector<toff_t> offsets(levels, 0); // Filled in by libtiff.
+        TIFFSetField(t, TIFFTAG_SUBIFD, static_cast<std::uint16_t>(levels),
+            &offsets.front());
+    }
+    if (!write_tiff_page(t, Out, image))
+        return false;
+    io::WriteImageIn::imageType reduced[2];
+    const io::WriteImageIn::imageType* source = &image;
+    for (int level = 0; level < levels; ++level) {
+        io::WriteImageIn::imageType& target(reduced[level % 2]);
+        downsample(*source, target, Out);
+        if (!TIFFWriteDirectory(t))
+            return false;
+        TIFFSetField(t, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+        if (!write_tiff_page(t, Out, target))
+            return false;
+        source = &target;
+    }
+    return true;
+}
+
+// Sample data size plus room for strip offsets, byte counts and tags. Tile
+// padding is not counted.
+static std::uint64_t projected_tiff_size(const Output& Out,
+    const std::vector<io::WriteImageIn::imageType*>& Pages,
+    std::uint64_t& Data)
+{
+    Data = 0;
+    std::uint64_t size = 0;
+    for (auto page : Pages) {
+        const io::WriteImageIn::imageType& image(*page);
+        std::uint64_t width = image[0].size(), height = image.size();
+        int levels = level_count(image, Out.levels);
+        for (int level = 0; level <= levels; ++level) {
+            Data += width * height * image[0][0].size() * (Out.depth / 8);
+            size += 4096 + 16 * height;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+    return Data + size;
+}
+
+// Writes each image as a page in its own directory. Uses BigTIFF when the
+// result would not fit in the 4 GiB offsets of classic TIFF.
+static int write_tiff(const Output& Out,
+    const std::vector<io::WriteImageIn::imageType*>& Pages)
+{
+    const io::WriteImageIn::filenameType& filename(Out.filename);
+    std::uint64_t data;
+    bool big = 0xffffffffull < projected_tiff_size(Out, Pages, data) ||
+        Out.bigtiff;
+    AtomicFile file(filename);
+    int fd = file.Open();
+    if (fd == -1) {
+        std::cerr << "Failed to open output file: " << filename << std::endl;
+        return 1;
+    }
+    // Reserve space for the samples without changing file size, as libtiff
+    // appends to the end of the file.
+    if (Out.compression == COMPRESSION_NONE && !file.Reserve(data, false)) {
+        std::cerr << filename << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    // TIFFClose closes the descriptor it was given.
+    int tiff_fd = dup(fd);
+    TIFF* t = (tiff_fd == -1) ? nullptr :
+        TIFFFdOpen(tiff_fd, filename.c_str(), big ? "w8" : "w");
+    if (!t) {
+        if (tiff_fd != -1)
+            close(tiff_fd);
+        std::cerr << "Failed to open output file: " << filename << std::endl;
+        return 1;
+    }
+    for (size_t k = 0; k < Pages.size(); ++k) {
+        if (1 < Pages.size()) {
+            TIFFSetField(t, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+            TIFFSetField(t, TIFFTAG_PAGENUMBER, static_cast<std::uint16_t>(k),
+                static_cast<std::uint16_t>(Pages.size()));
+        }
+        if (!write_tiff_levels(t, Out, *Pages[k]) ||
+            (k + 1 < Pages.size() && !TIFFWriteDirectory(t)))
         {
             TIFFClose(t);
             std::cerr << "Error writing to output: " << filename << std::endl;
-            unlink(filename.c_str());
             return 2;
         }
     }
+    // TIFFClose writes the last directory and buffered data but does not
+    // report failure, so flush first to keep a broken file from replacing
+    // the earlier one.
+    bool flushed = TIFFFlush(t) != 0;
     TIFFClose(t);
+    if (!flushed) {
+        std::cerr << "Error writing to output: " << filename << std::endl;
+        return 2;
+    }
+    if (!file.Commit(Out.sync)) {
+        std::cerr << filename << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
     return 0;
 }
 #endif
 
-template<typename T>
-class Buffer : public std::vector<T> {
-public:
-    Buffer& operator<<(T c) {
-        this->push_back(c);
-        return *this;
-    }
+#if !defined(NO_PNG)
 
-    Buffer& write_u32(std::uint32_t s) {
-        this->push_back((s >> 24) & 0xff);
-        this->push_back((s >> 16) & 0xff);
-        this->push_back((s >> 8) & 0xff);
-        this->push_back(s & 0xff);
-        return *this;
+static int write_png(const std::string& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const PNGOptions& Options, bool Sync)
+{
+    AtomicFile file(filename);
+    int fd = file.Open();
+    if (fd == -1)
+        return 2;
+    PNGFileSink sink(fd);
+    PNGEncoder encoder;
+    if (!encoder.Encode(image, depth, sink, Options)) {
+        std::cerr << encoder.Error() << "\n";
+        return 1;
     }
-};
-
-#if !defined(NO_PNG)
+    return file.Commit(Sync) ? 0 : 3;
+}
 
-static int write_png(const char* filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static int writePNG(
+    const Output& Out, const io::WriteImageIn::imageType& image)
 {
-    std::ofstream out;
-    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename,
-        std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-    std::vector<unsigned char> buf = memoryPNG(image, depth);
-    if (buf.empty())
+    const io::WriteImageIn::filenameType& filename(Out.filename);
+    switch (write_png(filename, image, Out.depth, Out.png, Out.sync)) {
+    case 0: return 0;
+    case 1:
+        std::cerr << "Error creating PNG.\n";
         return 1;
-    out.write(reinterpret_cast<char*>(&buf.front()), buf.size());
-    out.close();
-    return 0;
+    case 2:
+        std::cerr << "Failed to open output file: " << filename << std::endl;
+        return 2;
+    case 3:
+        std::cerr << filename << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    std::cerr << "Unspecified error.\n";
+    return 4;
 }
 
-static int writePNG(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+#endif
+
+// NetPBM formats. PBM is written from 1-bit values where 0 is black.
+
+static const size_t netpbm_block = 1 << 20;
+
+// Stores components of Line as big-endian samples. Returns end of output.
+static char* netpbm_row(char* Out,
+    const io::WriteImageIn::imageType::value_type& Line, int Depth)
 {
-    try {
-        switch (write_png(filename.c_str(), image, depth)) {
-        case 0: return 0;
-        case 1:
-            std::cerr << "Error creating PNG.\n";
-            return 1;
+    if (Depth == 1) {
+        // PBM bit 1 is black, 8 pixels per byte with first in highest bit.
+        unsigned char byte = 0;
+        size_t x = 0;
+        for (auto& pixel : Line) {
+            byte = (byte << 1) | (pixel[0] == 0.0f);
+            if ((++x & 7) == 0) {
+                *Out++ = static_cast<char>(byte);
+                byte = 0;
+            }
         }
+        if (x & 7)
+            *Out++ = static_cast<char>(byte << (8 - (x & 7)));
+        return Out;
+    }
+    if (Depth == 8) {
+        for (auto& pixel : Line)
+            for (auto& component : pixel)
+                *Out++ = static_cast<char>(static_cast<unsigned char>(
+                    component));
+        return Out;
     }
-    catch (std::ofstream::failure& e) {
-        std::cerr << filename << ": " << e.what() << "\n";
+    for (auto& pixel : Line)
+        for (auto& component : pixel) {
+            std::uint16_t val = static_cast<std::uint16_t>(component);
+            *Out++ = static_cast<char>((val >> 8) & 0xff);
+            *Out++ = static_cast<char>(val & 0xff);
+        }
+    return Out;
+}
+
+// Writes Header and Rows rows of RowSize bytes. Row(Out, y) stores row y and
+// returns end of output. Rows are converted into a block that is written when
+// the next row does not fit.
+template<typename RowFunc>
+static int write_blocks(const Output& Out, const std::string& Header,
+    size_t RowSize, size_t Rows, RowFunc Row)
+{
+    const io::WriteImageIn::filenameType& filename(Out.filename);
+    AtomicFile file(filename);
+    if (file.Open() == -1) {
+        std::cerr << "Failed to open output file: " << filename << std::endl;
         return 2;
     }
-    catch (const char* e) {
-        std::cerr << e << "\n";
-        return 3;
+    // Size is known so running out of space is found before writing.
+    bool ok = file.Reserve(Header.size() + std::uint64_t(Rows) * RowSize, true);
+    std::vector<char> block(std::max(netpbm_block, RowSize));
+    size_t used = Header.size();
+    memcpy(block.data(), Header.c_str(), used);
+    for (size_t y = 0; ok && y < Rows; ++y) {
+        if (block.size() - used < RowSize) {
+            ok = file.Write(block.data(), used);
+            if (!ok)
+                break;
+            used = 0;
+        }
+        used = Row(block.data() + used, y) - block.data();
     }
-    std::cerr << "Unspecified error.\n";
-    return 4;
+    ok = ok && file.Write(block.data(), used) && file.Commit(Out.sync);
+    if (!ok) {
+        std::cerr << filename << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    return 0;
 }
 
-#endif
+static int write_netpbm(const Output& Out,
+    const io::WriteImageIn::imageType& image, const std::string& Header)
+{
+    const size_t row_size = (Out.depth == 1) ? (image[0].size() + 7) / 8 :
+        image[0].size() * image[0][0].size() * (Out.depth / 8);
+    return write_blocks(Out, Header, row_size, image.size(),
+        [&](char* Dest, size_t Y) {
+            return netpbm_row(Dest, image[Y], Out.depth); });
+}
+
+// Depth zero leaves out the maximum value, as PBM has none.
+static std::string netpbm_header(const char* Magic,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType Depth)
+{
+    std::stringstream header;
+    header << Magic << '\n' << image[0].size() << '\n' << image.size() << '\n';
+    if (Depth)
+        header << ((1 << Depth) - 1) << '\n';
+    return header.str();
+}
 
 // PPM, NetPBM color image binary format.
 
-static int writePPM(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static int writePPM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    return write_netpbm(Out, image, netpbm_header("P6", image, Out.depth));
+}
+
+// PGM, NetPBM grayscale image binary format.
+
+static int writePGM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    return write_netpbm(Out, image, netpbm_header("P5", image, Out.depth));
+}
+
+// PBM, NetPBM bitmap binary format.
+
+static int writePBM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    return write_netpbm(Out, image, netpbm_header("P4", image, 0));
+}
+
+// PAM, NetPBM arbitrary map with any number of components.
+
+static int writePAM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
 {
+    static const char* const tuple_types[] = {
+        "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+    std::stringstream header;
+    header << "P7\nWIDTH " << image[0].size() << "\nHEIGHT " << image.size()
+        << "\nDEPTH " << image[0][0].size()
+        << "\nMAXVAL " << ((1 << Out.depth) - 1) << '\n';
+    if (image[0][0].size() <= 4)
+        header << "TUPLTYPE " << tuple_types[image[0][0].size() - 1] << '\n';
+    header << "ENDHDR\n";
+    return write_netpbm(Out, image, header.str());
+}
+
+// Writes Magic header and components of each pixel on a line of text.
+static int write_plain(const char* Magic, bool Bitmap,
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    const io::WriteImageIn::filenameType& filename(Out.filename);
+    AtomicFile file(filename);
+    if (file.Open() == -1) {
+        std::cerr << "Failed to open output file: " << filename << std::endl;
+        return 2;
+    }
     std::ofstream out;
     out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename,
-        std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-    std::stringstream header;
-    header << "P6\n" << image[0].size() << '\n' << image.size() << '\n'
-        << ((1 << depth) - 1) << '\n';
-    out << header.str();
-    Buffer<char> buf;
+    out.open(file.Name(), std::ofstream::out | std::ofstream::trunc);
+    out << netpbm_header(Magic, image, Bitmap ? 0 : Out.depth);
     for (auto& line : image)
-        for (auto& pixel : line)
-            for (auto& component : pixel)
-                if (depth == 8)
-                    buf << static_cast<char>(static_cast<unsigned char>(
-                        component));
-                else {
-                    std::uint16_t val = static_cast<std::uint16_t>(component);
-                    buf << static_cast<char>((val >> 8) & 0xff)
-                        << static_cast<char>(val & 0xff);
-                }
-    out.write(&buf.front(), buf.size());
+        for (auto& pixel : line) {
+            if (Bitmap)
+                out << (pixel[0] == 0.0f);
+            else
+                for (size_t c = 0; c < pixel.size(); ++c)
+                    out << (c ? " " : "") << pixel[c];
+            out << '\n';
+        }
     out.close();
+    if (!file.Commit(Out.sync)) {
+        std::cerr << filename << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
     return 0;
 }
 
 // PPM, NetPBM color image text format.
 
-static int writePlainPPM(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static int writePlainPPM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
 {
-    std::ofstream out;
-    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename, std::ofstream::out | std::ofstream::trunc);
-    out << "P3\n" << image[0].size() << '\n' << image.size() << '\n'
-        << (1 << depth) - 1 << '\n';
-    for (auto& line : image)
-        for (auto& pixel : line) // We know there are 3 components.
-            out << pixel[0] << ' ' << pixel[1] << ' ' << pixel[2] << '\n';
-    out.close();
-    return 0;
+    return write_plain("P3", false, Out, image);
 }
 
-static int write_image(io::WriteImageIn& val) {
-    if (val.image().empty()) {
-        std::cerr << "Image has zero height.\n";
+// PGM, NetPBM grayscale image text format.
+
+static int writePlainPGM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    return write_plain("P2", false, Out, image);
+}
+
+// PBM, NetPBM bitmap text format.
+
+static int writePlainPBM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    return write_plain("P1", true, Out, image);
+}
+
+// PFM, portable float map. Values are written as they are, in native byte
+// order and from bottom row to top.
+
+static int writePFM(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    std::stringstream header;
+    header << ((image[0][0].size() == 1) ? "Pf" : "PF") << '\n'
+        << image[0].size() << ' ' << image.size() << '\n'
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        << "1.0\n";
+#else
+        << "-1.0\n";
+#endif
+    const size_t row_size =
+        image[0].size() * image[0][0].size() * sizeof(float);
+    return write_blocks(Out, header.str(), row_size, image.size(),
+        [&](char* Dest, size_t Y) {
+            for (auto& pixel : image[image.size() - 1 - Y]) {
+                memcpy(Dest, pixel.data(), pixel.size() * sizeof(float));
+                Dest += pixel.size() * sizeof(float);
+            }
+            return Dest; });
+}
+
+// Native image container. Samples are stored as they are in host byte order.
+
+static int writeNative(
+    const Output& Out, const io::WriteImageIn::imageType& image)
+{
+    NativeSample sample = Out.floating ? NativeFloat32 :
+        ((Out.depth == 8) ? NativeUInt8 : NativeUInt16);
+    NativeHeader h;
+    if (!nativeHeader(h, image.size(), image[0].size(), image[0][0].size(),
+        sample))
+    {
+        std::cerr << "Image too large.\n";
         return 1;
     }
-    if (val.image()[0].empty()) {
-        std::cerr << "Image has zero width.\n";
-        return 1;
+    std::string header(h.data, '\0');
+    memcpy(&header[0], &h, sizeof(h));
+    return write_blocks(Out, header, h.stride, image.size(),
+        [&](char* Dest, size_t Y) {
+            char* end = Dest + h.stride;
+            for (auto& pixel : image[Y])
+                for (auto& component : pixel) {
+                    if (sample == NativeFloat32) {
+                        memcpy(Dest, &component, sizeof(float));
+                        Dest += sizeof(float);
+                    } else if (sample == NativeUInt8)
+                        *Dest++ = static_cast<char>(
+                            static_cast<unsigned char>(component));
+                    else {
+                        std::uint16_t val =
+                            static_cast<std::uint16_t>(component);
+                        memcpy(Dest, &val, sizeof(val));
+                        Dest += sizeof(val);
+                    }
+                }
+            memset(Dest, 0, end - Dest);
+            return end; });
+}
+
+// Binary formats have 8 or 16-bit samples, text formats 1 to 16 bits and
+// bitmaps 1 bit. Zero components allows any number.
+
+enum NetPBMDepth { NetPBMBinary, NetPBMPlain, NetPBMBit };
+
+static const struct {
+    const char* name;
+    WriteFunc writer;
+    size_t components;
+    NetPBMDepth depth;
+} netpbm_formats[] = {
+    { "ppm", &writePPM, 3, NetPBMBinary },
+    { "p6-ppm", &writePPM, 3, NetPBMBinary },
+    { "p3-ppm", &writePlainPPM, 3, NetPBMPlain },
+    { "pgm", &writePGM, 1, NetPBMBinary },
+    { "p5-pgm", &writePGM, 1, NetPBMBinary },
+    { "p2-pgm", &writePlainPGM, 1, NetPBMPlain },
+    { "pbm", &writePBM, 1, NetPBMBit },
+    { "p4-pbm", &writePBM, 1, NetPBMBit },
+    { "p1-pbm", &writePlainPBM, 1, NetPBMBit },
+    { "pam", &writePAM, 0, NetPBMBinary },
+    { "p7-pam", &writePAM, 0, NetPBMBinary }
+};
+
+static int write_output(WriteFunc Writer, const Output& Out,
+    const io::WriteImageIn::imageType& Image)
+{
+    try {
+        return Writer(Out, Image);
     }
-    if (val.image()[0][0].empty()) {
-        std::cerr << "Image has zero depth.\n";
-        return 1;
+    catch (const std::ofstream::failure& f) {
+        std::cerr << f.code() << ' ' << f.what() << '\n';
+        return 2;
     }
-    // Check type presence. If not given, use file name extension.
-    if (!val.formatGiven()) {
-        size_t last = val.filename().find_last_of(".");
-        if (last == std::string::npos) {
-            std::cerr << "No format nor extension in filename.\n";
-            return 1;
+}
+
+#if !defined(NO_TIFF)
+static const struct {
+    const char* name;
+    std::uint16_t tag;
+} compressions[] = {
+    { "none", COMPRESSION_NONE },
+    { "packbits", COMPRESSION_PACKBITS },
+    { "lzw", COMPRESSION_LZW },
+    { "deflate", COMPRESSION_ADOBE_DEFLATE },
+    { "zstd", COMPRESSION_ZSTD }
+};
+
+static bool tiff_options(io::WriteImageIn& val,
+    const std::string* Compression, bool Strict, Output& Out)
+{
+    if (Strict && val.filterGiven()) {
+        std::cerr << "Filter is for PNG.\n";
+        return false;
+    }
+    if (Compression) {
+        Out.compression = 0;
+        for (auto& c : compressions)
+            if (strcasecmp(Compression->c_str(), c.name) == 0)
+                Out.compression = c.tag;
+        if (Out.compression == 0) {
+            std::cerr << "Unknown compression: " << *Compression
+                << std::endl;
+            return false;
+        }
+        if (!TIFFIsCODECConfigured(Out.compression)) {
+            std::cerr << "Compression not supported by libtiff: "
+                << *Compression << std::endl;
+            return false;
         }
-        val.format() = val.filename().substr(last + 1);
     }
-    WriteFunc writer = nullptr;
+    if (Out.predictor) {
+        if (Out.compression == COMPRESSION_NONE ||
+            Out.compression == COMPRESSION_PACKBITS)
+        {
+            std::cerr << "Predictor requires lzw, deflate or zstd.\n";
+            return false;
+        }
+        if (Out.floating) {
+            std::cerr << "Predictor requires integer samples.\n";
+            return false;
+        }
+    }
+    if (val.rows_per_stripGiven()) {
+        if (val.rows_per_strip() < 1) {
+            std::cerr << "Rows per strip must be positive.\n";
+            return false;
+        }
+        Out.rows_per_strip = val.rows_per_strip();
+    }
+    if (val.tileGiven()) {
+        if (val.tile() < 16 || val.tile() % 16 != 0) {
+            std::cerr << "Tile size must be a positive multiple of 16.\n";
+            return false;
+        }
+        if (val.rows_per_stripGiven()) {
+            std::cerr << "Give either tile or rows_per_strip.\n";
+            return false;
+        }
+        Out.tile = val.tile();
+    }
+    if (val.levelsGiven()) {
+        if (val.levels() < 0) {
+            std::cerr << "Negative number of levels.\n";
+            return false;
+        }
+        Out.levels = val.levels();
+    }
+    return true;
+}
+#endif
+
+#if !defined(NO_PNG)
+static bool png_options(io::WriteImageIn& val,
+    const std::string* Compression, Output& Out)
+{
+    if (val.filterGiven() && !pngFilter(val.filter(), Out.png)) {
+        std::cerr << "Unknown filter: " << val.filter() << std::endl;
+        return false;
+    }
+    // Last so that store overrides level and filter.
+    if (Compression && !pngCompression(*Compression, Out.png)) {
+        std::cerr << "Unknown PNG compression: " << *Compression
+            << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+static bool check_size(const io::WriteImageIn::imageType& Image,
+    const char* Name)
+{
+    if (Image.empty()) {
+        std::cerr << Name << " has zero height.\n";
+        return false;
+    }
+    if (Image[0].empty()) {
+        std::cerr << Name << " has zero width.\n";
+        return false;
+    }
+    if (Image[0][0].empty()) {
+        std::cerr << Name << " has zero depth.\n";
+        return false;
+    }
+    for (auto& line : Image)
+        if (line.front().size() != Image[0][0].size()) {
+            std::cerr << "Color component count not constant, " <<
+                line.front().size() << " != " << Image[0][0].size() << "\n";
+            return false;
+        }
+    return true;
+}
+
+// Limits values using minimum and range, and scales them to depth if it is
+// at most 16. Writer quantizes 32-bit values to keep precision.
+static void normalize(io::WriteImageIn::imageType& Image, float Minimum,
+    float Range, io::WriteImageIn::depthType Depth)
+{
+    float max = (Depth <= 16) ? float(1 << Depth) : 1.0f;
+    for (auto& line : Image)
+        for (auto& pixel : line)
+            for (auto& component : pixel) {
+                component -= Minimum;
+                if (component <= 0.0f)
+                    component = 0.0f;
+                else if (Range <= component)
+                    component = 1.0f;
+                else {
+                    component /= Range;
+                    if (1.0f < component)
+                        component = 1.0f;
+                }
+                if (Depth <= 16) {
+                    component = trunc(component * max);
+                    if (component == max)
+                        component = max - 1;
+                }
+            }
+}
+
+// One file to write. Options not given per output come from the shared
+// fields.
+struct Request {
+    std::string filename, format;
+    bool depth_given;
+    io::WriteImageIn::depthType depth;
+    const std::string* compression; // Null if not given.
+    bool own_compression; // From compressions, not the shared field.
+    bool strict; // Reject options that the format does not use.
+};
+
+struct Target {
+    Output out;
+    WriteFunc writer;
+    bool tiff;
+};
+
+static bool is_tiff(const std::string& Format) {
+    return strcasecmp(Format.c_str(), "tiff") == 0 ||
+        strcasecmp(Format.c_str(), "tif") == 0;
+}
+
+// Returns true if Compression is known for Format.
+static bool compression_applies(const std::string& Format,
+    const std::string& Compression)
+{
 #if !defined(NO_TIFF)
-    bool tiff = false;
+    if (is_tiff(Format))
+        for (auto& c : compressions)
+            if (strcasecmp(Compression.c_str(), c.name) == 0)
+                return true;
+#endif
+#if !defined(NO_PNG)
+    PNGOptions options;
+    if (strcasecmp(Format.c_str(), "png") == 0)
+        return pngCompression(Compression, options);
 #endif
-    if (strcasecmp(val.format().c_str(), "ppm") == 0 ||
-        strcasecmp(val.format().c_str(), "p6-ppm") == 0)
+    return false;
+}
+
+// Checks Req against the format and fills T. Returns 0 or 1 on error.
+static int setup_output(io::WriteImageIn& val, const Request& Req,
+    const io::WriteImageIn::imageType& first, bool floating, Target& T)
+{
+    const std::string& format(Req.format);
+    io::WriteImageIn::depthType depth = Req.depth;
+    WriteFunc writer = nullptr;
+    bool tiff = false;
+    const auto* netpbm = std::find_if(std::begin(netpbm_formats),
+        std::end(netpbm_formats), [&format](const auto& F) {
+            return strcasecmp(format.c_str(), F.name) == 0; });
+    if (netpbm == std::end(netpbm_formats))
+        netpbm = nullptr;
+    const bool pfm = strcasecmp(format.c_str(), "pfm") == 0;
+    const bool native = strcasecmp(format.c_str(), "native") == 0 ||
+        strcasecmp(format.c_str(), "nim") == 0;
+    const bool png = strcasecmp(format.c_str(), "png") == 0;
+    // Shared compression applies only to formats that know it.
+    const std::string* compression = Req.compression;
+    if (compression && !Req.strict && !Req.own_compression &&
+        !compression_applies(format, *compression))
+            compression = nullptr;
+    if (pfm) {
+        if (val.typeGiven() && !floating) {
+            std::cerr << "PFM supports only float type.\n";
+            return 1;
+        }
+        floating = true;
+    }
+    if (floating && !is_tiff(format) && !pfm && !native) {
+        std::cerr << "Float type not supported by format: " << format
+            << std::endl;
+        return 1;
+    } else if ((compression ||
+        (Req.strict && (val.levelGiven() || val.filterGiven()))) &&
+        !is_tiff(format) && !png)
+    {
+        std::cerr << "Compression not supported by format: " << format
+            << std::endl;
+        return 1;
+    } else if (Req.strict && (val.predictorGiven() ||
+        val.rows_per_stripGiven() || val.tileGiven() || val.levelsGiven() ||
+        (val.bigtiffGiven() && val.bigtiff() != 0)) && !is_tiff(format))
     {
-        // PPM-writer.
-        writer = &writePPM;
-        if (8 < val.depth())
-            val.depth() = 16;
-        else if (val.depth() <= 8)
-            val.depth() = 8;
-        if (val.image()[0][0].size() != 3) {
-            std::cerr << "Got " << val.image()[0][0].size() <<
-                " color planes, not 3.\n";
+        std::cerr << "TIFF options given for format: " << format
+            << std::endl;
+        return 1;
+    } else if (val.stackGiven() && !is_tiff(format)) {
+        std::cerr << "Stack not supported by format: " << format
+            << std::endl;
+        return 1;
+    } else if (netpbm) {
+        writer = netpbm->writer;
+        if (netpbm->depth == NetPBMBit)
+            depth = 1;
+        else if (netpbm->depth == NetPBMBinary)
+            depth = (8 < depth) ? 16 : 8;
+        else if (depth < 1)
+            depth = 1;
+        else if (16 < depth)
+            depth = 16;
+        if (netpbm->components &&
+            first[0][0].size() != netpbm->components)
+        {
+            std::cerr << "Got " << first[0][0].size() <<
+                " color planes, not " << netpbm->components << ".\n";
             return 1;
         }
-    } else if (strcasecmp(val.format().c_str(), "p3-ppm") == 0) {
-        // Plain text-format PPM writer.
-        writer = &writePlainPPM;
-        if (val.depth() < 1)
-            val.depth() = 1;
-        else if (16 < val.depth())
-            val.depth() = 16;
-        if (val.image()[0][0].size() != 3) {
-            std::cerr << "Got " << val.image()[0][0].size() <<
-                " color planes, not 3.\n";
+    } else if (native) {
+        writer = &writeNative;
+        if (floating)
+            depth = 32;
+        else
+            depth = (8 < depth) ? 16 : 8;
+    } else if (pfm) {
+        writer = &writePFM;
+        depth = 32;
+        if (first[0][0].size() != 1 && first[0][0].size() != 3) {
+            std::cerr << "Got " << first[0][0].size() <<
+                " color planes, not 1 or 3.\n";
             return 1;
         }
 #if !defined(NO_TIFF)
-    } else if (strcasecmp(val.format().c_str(), "tiff") == 0 ||
-        strcasecmp(val.format().c_str(), "tif") == 0)
-    {
+    } else if (is_tiff(format)) {
         // TIFF-writer.
         tiff = true;
-        writer = &writeTIFF;
-        if (8 < val.depth())
-            val.depth() = 16;
-        else if (val.depth() <= 8)
-            val.depth() = 8;
+        if (floating)
+            depth = (Req.depth_given && depth <= 16) ? 16 : 32;
+        else if (16 < depth)
+            depth = 32;
+        else if (8 < depth)
+            depth = 16;
+        else if (depth <= 8)
+            depth = 8;
+        if (!floating && first[0][0].size() < 3 && depth == 16)
+            depth = 8; // Grayscale TIFF does not support 16-bit depth.
 #endif
 #if !defined(NO_PNG)
-    } else if (strcasecmp(val.format().c_str(), "png") == 0) {
+    } else if (png) {
         // PNG-writer.
         writer = &writePNG;
-        if (8 < val.depth())
-            val.depth() = 16;
-        else if (val.depth() <= 8)
-            val.depth() = 8;
-        if (4 < val.image()[0][0].size()) {
+        if (8 < depth)
+            depth = 16;
+        else if (depth <= 8)
+            depth = 8;
+        if (4 < first[0][0].size()) {
             std::cerr << "Too many color planes: " <<
-                val.image()[0][0].size() << std::endl;
+                first[0][0].size() << std::endl;
             return 1;
         }
 #endif
     } else {
-        std::cerr << "Unsupported format: " << val.format() << std::endl;
+        std::cerr << "Unsupported format: " << format << std::endl;
         return 1;
     }
-    // Find minimum and maximum, if at least one is missing.
-    if (!val.minimumGiven() || !val.maximumGiven()) {
-        if (!val.minimumGiven())
-            val.minimum() = val.image()[0][0][0];
-        if (!val.maximumGiven())
-            val.maximum() = val.image()[0][0][0];
-        for (auto& line : val.image())
-            for (auto& pixel : line)
-                for (auto& component : pixel) {
-                    if (!val.minimumGiven() && component < val.minimum())
-                        val.minimum() = component;
-                    if (!val.maximumGiven() && val.maximum() < component)
-                        val.maximum() = component;
-                }
+    T.writer = writer;
+    T.tiff = tiff;
+    T.out = Output { Req.filename, depth, floating,
+        tiff && val.bigtiffGiven() && val.bigtiff() != 0, 1,
+        tiff && val.predictorGiven() && val.predictor() != 0, 0, 0, 0,
+        PNGOptions(), val.syncGiven() && val.sync() != 0, 1 };
+    if (val.levelGiven()) {
+        if (val.level() < 0 || 9 < val.level()) {
+            std::cerr << "Compression level not in 0 to 9.\n";
+            return 1;
+        }
+        T.out.png.level = val.level();
     }
-    // Limit values using minimum and maximum.
-    float range = val.maximum() - val.minimum();
-    if (range < 0) {
-        std::cerr << "Maximum (" << val.maximum() << ") < minimum ("
-            << val.minimum() << ").\n";
+#if !defined(NO_TIFF)
+    if (tiff && !tiff_options(val, compression, Req.strict, T.out))
+        return 1;
+#endif
+#if !defined(NO_PNG)
+    if (png && !png_options(val, compression, T.out))
         return 1;
+#endif
+    return 0;
+}
+
+// Format from file name extension.
+static bool format_from_name(const std::string& Filename, std::string& Format)
+{
+    size_t last = Filename.find_last_of(".");
+    if (last == std::string::npos) {
+        std::cerr << "No format nor extension in filename: " << Filename
+            << std::endl;
+        return false;
     }
-    for (auto& line : val.image()) {
-        if (line.front().size() != val.image()[0][0].size()) {
-            std::cerr << "Color component count not constant, " <<
-                line.front().size() << " != " << val.image()[0][0].size() << "\n";
+    Format = Filename.substr(last + 1);
+    return true;
+}
+
+// Filename and outputs each give a request. Per-output formats, depths and
+// compressions are matched to outputs by index.
+static int requests(io::WriteImageIn& val, std::vector<Request>& Reqs) {
+    const size_t count = val.outputsGiven() ? val.outputs().size() : 0;
+    if ((val.formatsGiven() && val.formats().size() != count) ||
+        (val.depthsGiven() && val.depths().size() != count) ||
+        (val.compressionsGiven() && val.compressions().size() != count))
+    {
+        std::cerr << "Formats, depths and compressions must match outputs.\n";
+        return 1;
+    }
+    const bool strict = (val.filenameGiven() ? 1 : 0) + count == 1;
+    if (val.filenameGiven()) {
+        Request r { val.filename(), std::string(), val.depthGiven(),
+            val.depth(), val.compressionGiven() ? &val.compression() : nullptr,
+            false, strict };
+        if (val.formatGiven())
+            r.format = val.format();
+        else if (!format_from_name(r.filename, r.format))
             return 1;
+        Reqs.push_back(r);
+    }
+    for (size_t k = 0; k < count; ++k) {
+        Request r { val.outputs()[k], std::string(), val.depthGiven(),
+            val.depth(), val.compressionGiven() ? &val.compression() : nullptr,
+            false, strict };
+        if (val.formatsGiven())
+            r.format = val.formats()[k];
+        else if (val.formatGiven())
+            r.format = val.format();
+        else if (!format_from_name(r.filename, r.format))
+            return 1;
+        if (val.depthsGiven()) {
+            r.depth_given = true;
+            r.depth = val.depths()[k];
         }
-        for (auto& pixel : line) {
-            for (auto& component : pixel) {
-                component -= val.minimum();
-                if (component <= 0.0f)
-                    component = 0.0f;
-                else if (range <= component)
-                    component = 1.0f;
-                else {
-                    component /= range;
-                    if (1.0f < component)
-                        component = 1.0f;
-                }
-            }
+        if (val.compressionsGiven()) {
+            r.compression = &val.compressions()[k];
+            r.own_compression = true;
         }
+        Reqs.push_back(r);
     }
-#if !defined(NO_TIFF)
-    if (tiff && val.image()[0][0].size() < 3)
-        val.depth() = 8; // Grayscale TIFF does not support 16-bit depth.
-#endif
-    // Scale the components here since depth is known.
-    float max = 1 << val.depth();
-    for (auto& line : val.image())
-        for (auto& pixel : line)
-            for (auto& component : pixel) {
-                component = trunc(component * max);
-                if (component == max)
-                    component = max - 1;
-            }
-    try {
-        writer(val.filename(), val.image(), val.depth());
+    if (Reqs.empty()) {
+        std::cerr << "Give filename or outputs.\n";
+        return 1;
     }
-    catch (std::ofstream::failure f) {
-        unlink(val.filename().c_str());
-        std::cerr << f.code() << ' ' << f.what() << '\n';
-        return 2;
+    return 0;
+}
+
+static int write_image(io::WriteImageIn& val) {
+    std::vector<io::WriteImageIn::imageType*> pages;
+    if (val.stackGiven() == val.imageGiven()) {
+        std::cerr << "Give either image or stack.\n";
+        return 1;
+    }
+    if (val.imageGiven()) {
+        if (!check_size(val.image(), "Image"))
+            return 1;
+        pages.push_back(&val.image());
+    } else {
+        if (val.stack().empty()) {
+            std::cerr << "Stack has no pages.\n";
+            return 1;
+        }
+        for (auto& page : val.stack()) {
+            if (!check_size(page, "Page"))
+                return 1;
+            pages.push_back(&page);
+        }
+    }
+    const io::WriteImageIn::imageType& first(*pages.front());
+    bool floating = false;
+    if (val.typeGiven()) {
+        if (val.type() == "float")
+            floating = true;
+        else if (val.type() != "uint") {
+            std::cerr << "Unsupported type: " << val.type() << std::endl;
+            return 1;
+        }
     }
+    std::vector<Request> reqs;
+    if (requests(val, reqs))
+        return 1;
+    std::vector<Target> targets(reqs.size());
+    for (size_t k = 0; k < reqs.size(); ++k)
+        if (setup_output(val, reqs[k], first, floating, targets[k]))
+            return 1;
+    // Outputs with the same integer depth share normalized pages. Floating
+    // point outputs use the values as they are.
+    std::vector<io::WriteImageIn::depthType> depths;
+    bool unchanged = false;
+    for (auto& t : targets)
+        if (t.out.floating)
+            unchanged = true;
+        else if (std::find(depths.begin(), depths.end(), t.out.depth) ==
+            depths.end())
+                depths.push_back(t.out.depth);
+    std::vector<std::vector<io::WriteImageIn::imageType>> copies;
+    std::vector<std::vector<io::WriteImageIn::imageType*>> normalized;
+    if (!depths.empty()) {
+        // Find minimum and maximum, if at least one is missing.
+        if (!val.minimumGiven() || !val.maximumGiven()) {
+            if (!val.minimumGiven())
+                val.minimum() = first[0][0][0];
+            if (!val.maximumGiven())
+                val.maximum() = first[0][0][0];
+            for (auto page : pages)
+                for (auto& line : *page)
+                    for (auto& pixel : line)
+                        for (auto& component : pixel) {
+                            if (!val.minimumGiven() &&
+                                component < val.minimum())
+                                    val.minimum() = component;
+                            if (!val.maximumGiven() &&
+                                val.maximum() < component)
+                                    val.maximum() = component;
+                        }
+        }
+        float range = val.maximum() - val.minimum();
+        if (range < 0) {
+            std::cerr << "Maximum (" << val.maximum() << ") < minimum ("
+                << val.minimum() << ").\n";
+            return 1;
+        }
+        // The last depth uses the input unless values are needed as they are.
+        const size_t copied = depths.size() - (unchanged ? 0 : 1);
+        copies.resize(copied);
+        normalized.resize(depths.size());
+        for (size_t d = 0; d < depths.size(); ++d)
+            if (d < copied) {
+                copies[d].reserve(pages.size());
+                for (auto page : pages) {
+                    copies[d].push_back(*page);
+                    normalized[d].push_back(&copies[d].back());
+                }
+            } else
+                normalized[d] = pages;
+        // Pages are independent so convert them in parallel.
+        const size_t count = depths.size() * pages.size();
+        for_each_parallel(count, hardware_threads(), [&](size_t k) {
+            size_t d = k / pages.size();
+            normalize(*normalized[d][k % pages.size()], val.minimum(), range,
+                depths[d]);
+        });
+    }
+    // Outputs are written concurrently and divide the threads for encoding
+    // between them, so that the total stays near the thread count.
+    const size_t threads = hardware_threads();
+    for (size_t k = 0; k < targets.size(); ++k) {
+        size_t share = threads / targets.size() +
+            ((k < threads % targets.size()) ? 1 : 0);
+        targets[k].out.threads = std::max(size_t(1), share);
+        targets[k].out.png.threads = targets[k].out.threads;
+    }
+    std::vector<int> status(targets.size(), 0);
+    for_each_parallel(targets.size(), threads, [&](size_t k) {
+        const Target& t(targets[k]);
+        const std::vector<io::WriteImageIn::imageType*>& source(
+            t.out.floating ? pages : normalized[
+                std::find(depths.begin(), depths.end(), t.out.depth) -
+                    depths.begin()]);
+#if !defined(NO_TIFF)
+        if (t.tiff) {
+            status[k] = write_tiff(t.out, source);
+            return;
+        }
+#endif
+        status[k] = write_output(t.writer, t.out, *source.front());
+    });
+    for (int s : status)
+        if (s)
+            return s;
     return 0;
 }
 
@@ -0,0 +1,24 @@
+#!/bin/sh
+
+if [ $# -ne 5 ]; then
+    echo "Usage: $(basename $0) width height components depth merge2planes"
+    exit 1
+fi
+
+W=$1
+H=$2
+C=$3
+D=$4
+MP=$5
+
+rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile
+
+$MP < merge2planes_io.json > out.json
+
+pixeldiff --reference writeimage_io.json --test out.json --depth $D
+STATUS=$?
+
+if [ -z $KEEP ]; then
+    rm -f writeimage_io.json readimage_io.json split2planes_io.json merge2planes_io.json out.json
+fi
+exit $STATUS
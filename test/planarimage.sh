@@ -0,0 +1,31 @@
+#!/bin/sh
+
+if [ $# -lt 5 ]; then
+    echo "Usage: $(basename $0) width height components depth readimage [--channels list] [planartiff options]"
+    exit 1
+fi
+
+W=$1
+H=$2
+C=$3
+D=$4
+RI=$5
+shift 5
+CH=
+if [ "$1" = "--channels" ]; then
+    CH=$2
+    shift 2
+fi
+
+rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile --format tif ${CH:+--channels $CH}
+planartiff --input writeimage_io.json --output imagefile "$@"
+
+$RI < readimage_io.json > out.json
+
+pixeldiff --reference writeimage_io.json --test out.json --depth $D ${CH:+--channels $CH}
+STATUS=$?
+
+if [ -z $KEEP ]; then
+    rm -f imagefile writeimage_io.json readimage_io.json split2planes_io.json merge2planes_io.json out.json
+fi
+exit $STATUS
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+if [ $# -ne 5 ]; then
+    echo "Usage: $(basename $0) width height components depth writeimage"
+    exit 1
+fi
+
+W=$1
+H=$2
+C=$3
+D=$4
+WI=$5
+
+rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f bench.png --format png
+RAW=$(($W * $H * $C * $D / 8))
+
+# Time includes parsing the input, so compare settings with each other.
+for S in '"compression":"store"' '"level":1,"filter":"none"' \
+    '"level":1,"filter":"sub"' '"level":6' '"level":9,"filter":"all"'
+do
+    ruby -rjson -e "v = JSON.parse(File.read('writeimage_io.json'))
+File.write('bench_io.json', JSON.generate(v.merge(JSON.parse('{$S}'))))"
+    START=$(date +%s.%N)
+    $WI < bench_io.json || exit 1
+    END=$(date +%s.%N)
+    SIZE=$(wc -c < bench.png)
+    ruby -e "printf(\"%-30s %8.1f MB/s ratio %.3f\n\", '$S',
+$RAW / ($END - $START) / 1e6, $SIZE.0 / $RAW)"
+done
+
+rm -f bench.png bench_io.json writeimage_io.json readimage_io.json split2planes_io.json
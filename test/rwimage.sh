@@ -1,7 +1,7 @@
 #!/bin/sh
 
-if [ $# -ne 7 ]; then
-    echo "Usage: $(basename $0) width height components depth format readimage writeimage"
+if [ $# -lt 7 ]; then
+    echo "Usage: $(basename $0) width height components depth format readimage writeimage [rwimageinputgen options]"
     exit 1
 fi
 
@@ -12,16 +12,59 @@ D=$4
 F=$5
 RI=$6
 WI=$7
+shift 7
 
-rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile --format $F
+rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile --format $F "$@"
 
 $WI < writeimage_io.json
+
+# BigTIFF has version 43 in either byte order.
+case " $* " in
+*" --bigtiff "*)
+    case " $(od -An -tu1 -j2 -N2 imagefile | tr -s " ") " in
+    *" 43 0 "*|*" 0 43 "*) ;;
+    *)
+        echo "Not BigTIFF."
+        exit 1
+        ;;
+    esac
+    ;;
+esac
 $RI < readimage_io.json > out.json
+READ=$?
+
+# Selected channels are compared against those components of the reference.
+CH=$(echo " $* " | sed -n 's/.* --channels \([0-9,]*\) .*/\1/p')
+
+# Values pass through JSON as single-precision floats.
+P=$D
+if [ $P -gt 20 ]; then
+    P=20
+fi
+# Half floats keep 11 significant bits.
+case " $* " in
+*" --type float "*)
+    if [ $D -eq 16 ]; then
+        P=11
+    fi
+    ;;
+esac
 
-pixeldiff --reference writeimage_io.json --test out.json --depth $D
-STATUS=$?
+case " $* " in
+*" --read-fails "*)
+    STATUS=0
+    if [ $READ -eq 0 ]; then
+        echo "readimage did not fail."
+        STATUS=1
+    fi
+    ;;
+*)
+    pixeldiff --reference writeimage_io.json --test out.json --depth $P ${CH:+--channels $CH}
+    STATUS=$?
+    ;;
+esac
 
 if [ -z $KEEP ]; then
-    rm -f imagefile writeimage_io.json readimage_io.json split2planes_io.json out.json
+    rm -f imagefile imagefile.* writeimage_io.json readimage_io.json split2planes_io.json merge2planes_io.json out.json
 fi
 exit $STATUS
@@ -1,7 +1,7 @@
 #!/bin/sh
 
-if [ $# -ne 6 ]; then
-    echo "Usage: $(basename $0) width height components depth index split2planes"
+if [ $# -lt 6 ]; then
+    echo "Usage: $(basename $0) width height components depth index split2planes [--outputs count]"
     exit 1
 fi
 
@@ -11,6 +11,7 @@ C=$3
 D=$4
 I=$5
 SP=$6
+shift 6
 
 rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile
 
@@ -19,7 +20,37 @@ $SP < split2planes_io.json > out.json
 pixeldiff --reference split2planes_io.json --test out.json --depth $D --channel $I
 STATUS=$?
 
+# Planes written to files must equal those in standard output. With a count
+# that differs from components nothing is written.
+N=$(echo " $* " | sed -n 's/.* --outputs \([0-9]*\) .*/\1/p')
+if [ -n "$N" ] && [ $STATUS -eq 0 ]; then
+    rwimageinputgen -i pspecs -w $W -h $H -c $C -d $D -f imagefile --outputs $N
+    $SP < split2planes_io.json > outputs.json
+    WRITTEN=$?
+    if [ $N -ne $C ]; then
+        if [ $WRITTEN -eq 0 ] || [ -n "$(ls plane*.json 2>/dev/null)" ]; then
+            echo "Mismatched outputs count did not fail."
+            STATUS=1
+        fi
+    elif [ $WRITTEN -ne 0 ]; then
+        echo "Writing planes failed."
+        STATUS=1
+    else
+        ruby -rjson -e '
+            out = JSON.parse(File.read("out.json"))
+            files = JSON.parse(File.read("outputs.json"))["outputs"]
+            ok = files.size == out.size && out.keys.each_with_index.all? do |key, k|
+              files[k] == "#{key}.json" && JSON.parse(File.read(files[k])) == out[key]
+            end
+            exit(ok ? 0 : 1)'
+        if [ $? -ne 0 ]; then
+            echo "Plane files differ from output."
+            STATUS=1
+        fi
+    fi
+fi
+
 if [ -z $KEEP ]; then
-    rm -f writeimage_io.json readimage_io.json split2planes_io.json out.json
+    rm -f writeimage_io.json readimage_io.json split2planes_io.json merge2planes_io.json out.json outputs.json plane*.json
 fi
 exit $STATUS